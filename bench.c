@@ -0,0 +1,350 @@
+/* SPDX-License-Identifier: Unlicense
+ */
+
+/*
+ * Microbenchmarks of the input pipeline. main.c is built right into the
+ * benchmark, so its static functions are measured exactly as the daemon runs
+ * them, with a memfd in place of /dev/uinput. Every benchmark runs in batches
+ * of events and the time of a batch gives one ns/event sample, percentiles are
+ * taken over the samples. Captures given as arguments are replayed as well,
+ * and dictionary lookups are timed with a dictionary given with -w.
+ */
+
+#define main ds4_main
+#include "main.c"
+#undef main
+
+#define BENCH_BATCH 256 // Events per sample
+#define BENCH_WARMUP 64 // Samples thrown away
+#define BENCH_SAMPLES 4096
+#define BENCH_EVENTS_MAX 4096
+#define BENCH_PREFIXES 4096
+
+/* Processes about count events and returns how many it has processed */
+typedef size_t (*bench_fn)(size_t count);
+
+static double g_samples[BENCH_SAMPLES];
+static struct input_event g_bench_events[BENCH_EVENTS_MAX];
+static size_t g_bench_events_num = 0;
+static size_t g_bench_next = 0;
+static volatile uint32_t g_bench_sink; // Keeps the results from being optimized out
+static struct capture_record *g_bench_records;
+static struct input_event *g_bench_record_events;
+static size_t g_bench_records_num;
+static char g_bench_prefixes[BENCH_PREFIXES][DICT_WORD_MAX];
+static uint32_t g_bench_prefix_lens[BENCH_PREFIXES];
+
+static int compare_double(const void *a, const void *b)
+{
+    const double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void bench_run(const char *name, bench_fn fn)
+{
+    for (size_t i = 0; i < BENCH_WARMUP; i++) {
+        fn(BENCH_BATCH);
+    }
+    uint64_t total_ns = 0, total_events = 0;
+    size_t samples = 0;
+    for (size_t i = 0; i < BENCH_SAMPLES; i++) {
+        const uint64_t start_ns = monotonic_ns();
+        const size_t events = fn(BENCH_BATCH);
+        const uint64_t elapsed_ns = monotonic_ns() - start_ns;
+        if (events == 0)
+            continue;
+        g_samples[samples++] = (double)elapsed_ns / events;
+        total_ns += elapsed_ns;
+        total_events += events;
+    }
+    if (samples == 0 || total_ns == 0) {
+        printf("%-28s no events\n", name);
+        return;
+    }
+    qsort(g_samples, samples, sizeof(g_samples[0]), compare_double);
+    printf("%-28s %8.1f ns/event %12.0f events/sec  p50 %.1f  p90 %.1f  p99 %.1f\n",
+            name,
+            (double)total_ns / total_events,
+            total_events * 1e9 / total_ns,
+            g_samples[samples * 50 / 100],
+            g_samples[samples * 90 / 100],
+            g_samples[samples * 99 / 100]);
+}
+
+/* Attaches controller 0 in keyboard mode, writing to a memfd */
+static struct controller *bench_attach(void)
+{
+    struct controller *ctl = &g_controllers[0];
+    memset(ctl, 0, sizeof(*ctl));
+    ctl->used = true;
+    reader_init(&ctl->reader, -1);
+    ctl->reader.clockid = CLOCK_MONOTONIC;
+    calibration_apply(ctl, &g_default_calibration);
+    ctl->out = &g_outputs[0];
+    ctl->out->fd = memfd_create("uinput", MFD_CLOEXEC);
+    if (ctl->out->fd == -1) {
+        perror("memfd_create");
+        exit(1);
+    }
+    ctl->state.keyboard_mode = true;
+    return ctl;
+}
+
+/* Writes every batch from the start of the memfd, so it doesn't grow */
+static void bench_rewind(struct output *out)
+{
+    output_flush(out);
+    lseek(out->fd, 0, SEEK_SET);
+}
+
+static uint8_t triangle(size_t i, size_t period)
+{
+    const size_t phase = i % period;
+    return (phase < period / 2 ? phase : period - phase) * 255 / (period / 2);
+}
+
+/* Both axes of the left stick wander around at different rates */
+static void bench_stick_events(void)
+{
+    g_bench_events_num = 0;
+    for (size_t i = 0; g_bench_events_num + 2 <= BENCH_EVENTS_MAX; i++) {
+        g_bench_events[g_bench_events_num++] = (struct input_event){
+            .type = EV_ABS, .code = ABS_X, .value = triangle(i, 97),
+        };
+        g_bench_events[g_bench_events_num++] = (struct input_event){
+            .type = EV_ABS, .code = ABS_Y, .value = triangle(i, 131),
+        };
+    }
+}
+
+/* Presses and releases every chord of g_mapping, the first side first */
+static void bench_chord_events(void)
+{
+    g_bench_events_num = 0;
+    for (size_t m = 0; m < MAPPINGS_NUM; m++) {
+        const struct mapping *mapping = &g_mapping[m];
+        struct input_event events[8];
+        size_t count = 0;
+        for (int pass = 0; pass < 2; pass++) {
+            for (size_t i = 0; i < INPUT_CLASSES_NUM; i++) {
+                const struct input_class *input = &g_inputs[i];
+                if (input->kind != INPUT_CHORD || (input->side == mapping->first) != (pass == 0))
+                    continue;
+                for (int positive = 0; positive < 2; positive++) {
+                    if (!(mapping->keys & input->mask[positive]) || count == sizeof(events) / sizeof(events[0]))
+                        continue;
+                    const bool key = i < INPUT_KEYS_NUM;
+                    events[count++] = (struct input_event){
+                        .type = key ? EV_KEY : EV_ABS,
+                        .code = key ? BTN_SOUTH + i : i - INPUT_KEYS_NUM,
+                        .value = key || positive ? 1 : -1,
+                    };
+                    /* Buttons have the same mask for both values */
+                    if (key)
+                        break;
+                }
+            }
+        }
+        if (g_bench_events_num + count * 2 > BENCH_EVENTS_MAX)
+            break;
+        for (size_t i = 0; i < count; i++) {
+            g_bench_events[g_bench_events_num++] = events[i];
+        }
+        for (size_t i = 0; i < count; i++) {
+            g_bench_events[g_bench_events_num] = events[i];
+            g_bench_events[g_bench_events_num++].value = 0;
+        }
+    }
+}
+
+static size_t bench_stick(size_t count)
+{
+    struct controller *ctl = &g_controllers[0];
+    for (size_t i = 0; i < count; i++) {
+        const struct input_event ev = g_bench_events[g_bench_next];
+        g_bench_next = (g_bench_next + 1) % g_bench_events_num;
+        ctl->reader.abs[ev.code] = ev.value;
+        handle_event(ctl, ev);
+    }
+    bench_rewind(ctl->out);
+    return count;
+}
+
+static size_t bench_chords(size_t count)
+{
+    struct controller *ctl = &g_controllers[0];
+    for (size_t i = 0; i < count; i++) {
+        handle_event(ctl, g_bench_events[g_bench_next]);
+        g_bench_next = (g_bench_next + 1) % g_bench_events_num;
+    }
+    bench_rewind(ctl->out);
+    return count;
+}
+
+static size_t bench_chord_lookup(size_t count)
+{
+    uint32_t sum = 0;
+    for (size_t i = 0; i < count; i++) {
+        const struct mapping *mapping = &g_mapping[g_bench_next];
+        g_bench_next = (g_bench_next + 1) % MAPPINGS_NUM;
+        sum += g_layout->chords[chord_index(mapping->first, mapping->keys)];
+    }
+    g_bench_sink += sum;
+    return count;
+}
+
+/* Key taps built into the output buffer, without writing them */
+static size_t bench_output_build(size_t count)
+{
+    struct output *out = g_controllers[0].out;
+    const struct timeval timestamp = {0};
+    for (size_t i = 0; i < count; i++) {
+        if (out->len + 4 > OUTPUT_MAX)
+            out->len = 0;
+        emulate_key(out, g_layout->keys[g_bench_next], timestamp);
+        g_bench_next = (g_bench_next + 1) % g_layout->keys_num;
+    }
+    out->len = 0;
+    return count;
+}
+
+/* Key taps written one per frame, as chords are */
+static size_t bench_output_write(size_t count)
+{
+    struct output *out = g_controllers[0].out;
+    const struct timeval timestamp = {0};
+    for (size_t i = 0; i < count; i++) {
+        emulate_key(out, g_layout->keys[g_bench_next], timestamp);
+        g_bench_next = (g_bench_next + 1) % g_layout->keys_num;
+        output_flush(out);
+    }
+    lseek(out->fd, 0, SEEK_SET);
+    return count;
+}
+
+/* Prefixes of random dictionary words, as typed before asking for completion */
+static void bench_prefixes(void)
+{
+    srand(1);
+    for (size_t i = 0; i < BENCH_PREFIXES; i++) {
+        const struct dict_word *word = &g_dict_words[(uint32_t)rand() % g_dict->words_num];
+        const uint32_t len = word->len ? 1 + (uint32_t)rand() % word->len : 0;
+        memcpy(g_bench_prefixes[i], g_dict_text + word->text, len);
+        g_bench_prefix_lens[i] = len;
+    }
+}
+
+static size_t bench_dict_lookup(size_t count)
+{
+    uint32_t sum = 0;
+    for (size_t i = 0; i < count; i++) {
+        const uint32_t node = dict_lookup(g_bench_prefixes[g_bench_next], g_bench_prefix_lens[g_bench_next]);
+        g_bench_next = (g_bench_next + 1) % BENCH_PREFIXES;
+        sum += node == DICT_NONE ? 0 : g_dict_nodes[node].top[0];
+    }
+    g_bench_sink += sum;
+    return count;
+}
+
+/* Records of the capture fed the same way as replay does, over and over */
+static size_t bench_capture(size_t count)
+{
+    if (g_bench_next >= g_bench_records_num) {
+        g_bench_next = 0;
+        for (size_t i = 0; i < CONTROLLERS_MAX; i++) {
+            g_outputs[i].sink_len = 0;
+        }
+    }
+    const size_t end = g_bench_next + count < g_bench_records_num ? g_bench_next + count : g_bench_records_num;
+    const size_t stop = replay_feed(g_bench_records, g_bench_record_events, g_bench_next, end);
+    const size_t done = stop - g_bench_next;
+    g_bench_next = stop;
+    return done;
+}
+
+static void bench_detach_all(void)
+{
+    for (size_t i = 0; i < CONTROLLERS_MAX; i++) {
+        if (g_outputs[i].fd != -1)
+            close(g_outputs[i].fd);
+        free(g_outputs[i].sink);
+        memset(&g_outputs[i], 0, sizeof(g_outputs[i]));
+        g_outputs[i].fd = -1;
+        memset(&g_controllers[i], 0, sizeof(g_controllers[i]));
+    }
+    memset(g_repeats, 0, sizeof(g_repeats));
+    g_bench_next = 0;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *layout_path = NULL, *dict_path = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "l:w:")) != -1) {
+        switch (opt) {
+        case 'l':
+            layout_path = optarg;
+            break;
+        case 'w':
+            dict_path = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-l layout] [-w dictionary] [capture]...\n", argv[0]);
+            exit(1);
+        }
+    }
+    g_verbosity = 0;
+    for (size_t i = 0; i < CONTROLLERS_MAX; i++) {
+        g_outputs[i].fd = -1;
+    }
+    build_builtin_layout();
+    if (layout_path) {
+        struct keymap *keymap = keymap_load(layout_path);
+        if (keymap == NULL)
+            exit(1);
+        keymap_use(keymap);
+    }
+    if (dict_path) {
+        g_dict = dict_load(dict_path);
+        if (g_dict == NULL)
+            exit(1);
+    }
+
+    bench_attach();
+    bench_stick_events();
+    bench_run("stick binarization", bench_stick);
+    bench_detach_all();
+
+    bench_attach();
+    bench_chord_events();
+    bench_run("chord transitions", bench_chords);
+    bench_detach_all();
+
+    bench_attach();
+    bench_run("chord lookup", bench_chord_lookup);
+    bench_run("output building", bench_output_build);
+    bench_run("output write", bench_output_write);
+    bench_detach_all();
+
+    if (g_dict && g_dict->words_num > 0) {
+        bench_prefixes();
+        bench_run("dictionary lookup", bench_dict_lookup);
+        g_bench_next = 0;
+    }
+
+    for (int i = optind; i < argc; i++) {
+        size_t events_num;
+        const ssize_t count = replay_load(argv[i], &g_bench_records, &g_bench_record_events, &events_num);
+        if (count == -1)
+            exit(1);
+        g_bench_records_num = count;
+        char name[64];
+        const char *base = strrchr(argv[i], '/');
+        snprintf(name, sizeof(name), "replay %s", base ? base + 1 : argv[i]);
+        bench_run(name, bench_capture);
+        bench_detach_all();
+        free(g_bench_records);
+        free(g_bench_record_events);
+    }
+    return 0;
+}
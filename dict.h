@@ -0,0 +1,51 @@
+/* SPDX-License-Identifier: Unlicense
+ */
+
+/*
+ * Word dictionary image shared by main and the dictionary compiler. It is a
+ * radix trie (edges are labelled with whole substrings, not single letters)
+ * where every node keeps the most frequent words below it, so completing a
+ * prefix is a walk down the trie with no search over the words at all.
+ *
+ * The image is a header followed by the arrays of nodes, edges, words and
+ * the text, with labels and words being slices of the text.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#define DICT_MAGIC "DS4DICT1"
+#define DICT_VERSION 1
+/* Completions offered for a prefix */
+#define DICT_CANDIDATES 4
+#define DICT_WORD_MAX 32
+#define DICT_NONE UINT32_MAX
+
+struct dict_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t nodes_num; // The first node is the root
+    uint32_t edges_num;
+    uint32_t words_num;
+    uint32_t text_size;
+    uint32_t reserved;
+};
+
+struct dict_node {
+    uint32_t edges_first; // Edges of a node are sorted by their first letter
+    uint32_t edges_num;
+    uint32_t top[DICT_CANDIDATES]; // Words by descending frequency, DICT_NONE if fewer
+};
+
+struct dict_edge {
+    uint32_t label; // Offset in the text
+    uint32_t label_len;
+    uint32_t node;
+};
+
+struct dict_word {
+    uint32_t text; // Offset in the text
+    uint32_t len;
+    uint32_t freq;
+};
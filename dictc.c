@@ -0,0 +1,222 @@
+/* SPDX-License-Identifier: Unlicense
+ */
+
+/*
+ * Dictionary compiler. Turns a word frequency list into the trie image (see
+ * dict.h) that main maps with the -w option. Every line of the list is a word
+ * optionally followed by its count. Lines without a count rank by their order,
+ * so a plain list of words sorted by frequency works as is.
+ */
+
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <ctype.h>
+
+#include "dict.h"
+
+struct word {
+    char *text;
+    uint32_t len;
+    uint32_t freq;
+    uint32_t rank; // Line number, breaks ties in frequency
+};
+
+static struct word *g_words = NULL;
+static size_t g_words_num = 0;
+static struct dict_node *g_nodes = NULL;
+static size_t g_nodes_num = 0, g_nodes_cap = 0;
+static struct dict_edge *g_edges = NULL;
+static size_t g_edges_num = 0, g_edges_cap = 0;
+static uint32_t *g_text_offsets = NULL;
+
+static void *grow(void *array, size_t *cap, size_t num, size_t size)
+{
+    if (num < *cap)
+        return array;
+    *cap = *cap ? *cap * 2 : 1024;
+    array = realloc(array, *cap * size);
+    if (array == NULL) {
+        perror("realloc");
+        exit(1);
+    }
+    return array;
+}
+
+static bool better(const struct word *a, const struct word *b)
+{
+    return a->freq != b->freq ? a->freq > b->freq : a->rank < b->rank;
+}
+
+static int compare_text(const void *a, const void *b)
+{
+    return strcmp(((const struct word *)a)->text, ((const struct word *)b)->text);
+}
+
+static int read_words(const char *path)
+{
+    FILE *input = fopen(path, "r");
+    if (input == NULL) {
+        fprintf(stderr, "\"%s\": ", path);
+        perror("fopen");
+        return 1;
+    }
+    size_t cap = 0, skipped = 0;
+    char line[256];
+    for (uint32_t rank = 1; fgets(line, sizeof(line), input); rank++) {
+        char *text = strtok(line, " \t\r\n");
+        char *count = strtok(NULL, " \t\r\n");
+        if (text == NULL || text[0] == '#')
+            continue;
+        size_t len = strlen(text);
+        bool valid = len <= DICT_WORD_MAX;
+        for (size_t i = 0; i < len && valid; i++) {
+            text[i] = tolower((unsigned char)text[i]);
+            valid = text[i] >= 'a' && text[i] <= 'z';
+        }
+        if (!valid) {
+            skipped++;
+            continue;
+        }
+        g_words = grow(g_words, &cap, g_words_num, sizeof(g_words[0]));
+        g_words[g_words_num++] = (struct word){
+            .text = strdup(text),
+            .len = len,
+            .freq = count ? strtoul(count, NULL, 10) : 0,
+            .rank = rank,
+        };
+    }
+    fclose(input);
+    if (skipped)
+        fprintf(stderr, "%s: skipped %zu words that are not plain latin letters\n", path, skipped);
+    qsort(g_words, g_words_num, sizeof(g_words[0]), compare_text);
+    /* Merge duplicates, keeping the best of their ranks */
+    size_t unique = 0;
+    for (size_t i = 0; i < g_words_num; i++) {
+        if (unique > 0 && strcmp(g_words[unique - 1].text, g_words[i].text) == 0) {
+            if (better(&g_words[i], &g_words[unique - 1]))
+                g_words[unique - 1] = g_words[i];
+            continue;
+        }
+        g_words[unique++] = g_words[i];
+    }
+    g_words_num = unique;
+    return 0;
+}
+
+/*
+ * Builds the node for the sorted words [lo, hi) sharing the first depth
+ * letters and returns its index.
+ */
+static uint32_t build(size_t lo, size_t hi, uint32_t depth)
+{
+    g_nodes = grow(g_nodes, &g_nodes_cap, g_nodes_num, sizeof(g_nodes[0]));
+    const uint32_t index = g_nodes_num++;
+    struct dict_node node = {0};
+    for (size_t k = 0; k < DICT_CANDIDATES; k++) {
+        node.top[k] = DICT_NONE;
+    }
+    for (size_t i = lo; i < hi; i++) {
+        for (size_t k = 0; k < DICT_CANDIDATES; k++) {
+            if (node.top[k] == DICT_NONE || better(&g_words[i], &g_words[node.top[k]])) {
+                memmove(&node.top[k + 1], &node.top[k], (DICT_CANDIDATES - k - 1) * sizeof(node.top[0]));
+                node.top[k] = i;
+                break;
+            }
+        }
+    }
+    /* The word ending right here sorts first and has no edge */
+    size_t start = lo < hi && g_words[lo].len == depth ? lo + 1 : lo;
+    size_t groups[27];
+    size_t groups_num = 0;
+    for (size_t i = start; i < hi; i++) {
+        if (i == start || g_words[i].text[depth] != g_words[i - 1].text[depth])
+            groups[groups_num++] = i;
+    }
+    groups[groups_num] = hi;
+    node.edges_first = g_edges_num;
+    node.edges_num = groups_num;
+    g_edges_num += groups_num;
+    g_edges = grow(g_edges, &g_edges_cap, g_edges_num, sizeof(g_edges[0]));
+    g_nodes[index] = node;
+    for (size_t g = 0; g < groups_num; g++) {
+        const struct word *first = &g_words[groups[g]];
+        const struct word *last = &g_words[groups[g + 1] - 1];
+        /* Sorted words share the prefix of the first and the last of them */
+        uint32_t lcp = depth + 1;
+        while (lcp < first->len && lcp < last->len && first->text[lcp] == last->text[lcp])
+            lcp++;
+        const uint32_t child = build(groups[g], groups[g + 1], lcp);
+        g_edges[node.edges_first + g] = (struct dict_edge){
+            .label = g_text_offsets[groups[g]] + depth,
+            .label_len = lcp - depth,
+            .node = child,
+        };
+    }
+    return index;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *image_path = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "o:")) != -1) {
+        switch (opt) {
+        case 'o':
+            image_path = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s -o image <words.txt>\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (optind >= argc || image_path == NULL) {
+        fprintf(stderr, "Error: No word list or image specified\n");
+        exit(1);
+    }
+    if (read_words(argv[optind]) != 0)
+        exit(1);
+    g_text_offsets = malloc((g_words_num + 1) * sizeof(g_text_offsets[0]));
+    struct dict_word *words = malloc((g_words_num + 1) * sizeof(words[0]));
+    if (g_text_offsets == NULL || words == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    uint32_t text_size = 0;
+    for (size_t i = 0; i < g_words_num; i++) {
+        g_text_offsets[i] = text_size;
+        words[i] = (struct dict_word){ .text = text_size, .len = g_words[i].len, .freq = g_words[i].freq };
+        text_size += g_words[i].len;
+    }
+    build(0, g_words_num, 0);
+    struct dict_header header = {
+        .version = DICT_VERSION,
+        .nodes_num = g_nodes_num,
+        .edges_num = g_edges_num,
+        .words_num = g_words_num,
+        .text_size = text_size,
+    };
+    memcpy(header.magic, DICT_MAGIC, sizeof(header.magic));
+    FILE *image = fopen(image_path, "wb");
+    if (image == NULL) {
+        fprintf(stderr, "\"%s\": ", image_path);
+        perror("fopen");
+        exit(1);
+    }
+    fwrite(&header, sizeof(header), 1, image);
+    fwrite(g_nodes, sizeof(g_nodes[0]), g_nodes_num, image);
+    fwrite(g_edges, sizeof(g_edges[0]), g_edges_num, image);
+    fwrite(words, sizeof(words[0]), g_words_num, image);
+    for (size_t i = 0; i < g_words_num; i++) {
+        fwrite(g_words[i].text, 1, g_words[i].len, image);
+    }
+    if (ferror(image) || fclose(image) != 0) {
+        fprintf(stderr, "\"%s\": ", image_path);
+        perror("write");
+        exit(1);
+    }
+    printf("%zu words, %zu nodes, %zu edges\n", g_words_num, g_nodes_num, g_edges_num);
+    return 0;
+}
@@ -3,6 +3,10 @@
 # Program will just exit on any failed check (an expression in square brackets) due to -e flag.
 set -e
 
+# Every run starts its own main with its own virtual keyboard, which goes away
+# when the gamepad disconnects. For a keyboard that stays across reconnects run
+# a single "main -m" instead, it attaches gamepads itself.
+
 devpath=$1
 program=$2
 [ -n "$devpath" ]
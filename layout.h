@@ -0,0 +1,154 @@
+/* SPDX-License-Identifier: Unlicense
+ */
+
+/*
+ * Layout definitions shared by main and the layout compiler. A compiled layout
+ * image is a struct layout written as is, so it can be read and used without
+ * any parsing.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum side {
+    SIDE_NO = 0,
+    SIDE_LEFT = 1,
+    SIDE_RIGHT = 2,
+};
+
+enum keys_mask {
+    KMASK_LEFT = 1 << 0,
+    KMASK_RIGHT = 1 << 1,
+    KMASK_UP = 1 << 2,
+    KMASK_DOWN = 1 << 3,
+    KMASK_WEST = 1 << 4,
+    KMASK_EAST = 1 << 5,
+    KMASK_NORTH = 1 << 6,
+    KMASK_SOUTH = 1 << 7,
+    KMASK_LT = 1 << 8,
+    KMASK_LB = 1 << 9,
+    KMASK_RT = 1 << 10,
+    KMASK_RB = 1 << 11,
+    KMASK_OPTIONS = 1 << 12,
+    KMASK_SHARE = 1 << 13,
+    KMASK_PS = 1 << 14,
+    KMASK_THUMBL = 1 << 15,
+    KMASK_THUMBR = 1 << 16,
+    KMASK_THUMBL_DOWN = 1 << 17,
+    KMASK_THUMBL_UP = 1 << 18,
+    KMASK_THUMBL_LEFT = 1 << 19,
+    KMASK_THUMBL_RIGHT = 1 << 20,
+    KMASK_THUMBR_DOWN = 1 << 21,
+    KMASK_THUMBR_UP = 1 << 22,
+    KMASK_THUMBR_LEFT = 1 << 23,
+    KMASK_THUMBR_RIGHT = 1 << 24,
+    KMASK_PRESSED = 1 << 29,
+    KMASK_SIDE_SHIFT = 30,
+    KMASK_CHORD_LEFT = KMASK_LEFT | KMASK_RIGHT | KMASK_UP | KMASK_DOWN,
+    KMASK_CHORD_RIGHT = KMASK_WEST | KMASK_EAST | KMASK_NORTH | KMASK_SOUTH,
+    KMASK_CHORD_KEYS = KMASK_CHORD_LEFT | KMASK_CHORD_RIGHT,
+};
+
+/* Triggers and bumpers acting as modifiers */
+enum modifier {
+    MODIFIER_LT = 0,
+    MODIFIER_RT = 1,
+    MODIFIER_LB = 2,
+    MODIFIER_RB = 3,
+    MODIFIERS_NUM,
+};
+
+/* Thumb-stick directions */
+enum stick_direction {
+    STICK_LEFT = 0,
+    STICK_RIGHT = 1,
+    STICK_UP = 2,
+    STICK_DOWN = 3,
+    STICK_DIRECTIONS_NUM,
+};
+
+#define CHORD_TABLE_SIZE (4 << 8)
+#define LAYOUT_KEYS_MAX 256
+
+/*
+ * Chord codes from LAYOUT_ACTION_FIRST on trigger actions of main instead of
+ * key presses, they are never registered as keys.
+ */
+#define LAYOUT_ACTION_FIRST 0xfe00
+#define LAYOUT_ACTION_MACRO 0xfe00 // Plus the index of the macro
+#define LAYOUT_ACTION_COMPLETE 0xff00 // Offer the next word completion
+#define LAYOUT_ACTION_ACCEPT 0xff01 // Accept the completion and end the word
+
+#define LAYOUT_MACROS_MAX 64
+#define LAYOUT_MACRO_STEPS_MAX 2048
+
+#define LAYOUT_MAGIC "DS4LAYOU"
+#define LAYOUT_VERSION 3
+
+/* A key event of a macro, code zero stands for SYN_REPORT */
+struct layout_step {
+    uint16_t code;
+    uint16_t value;
+};
+
+struct layout {
+    char magic[8];
+    uint32_t version;
+    uint32_t size; // sizeof(struct layout), guards against ABI mismatch
+    /* Output key code for every chord_index(), zero if there is none */
+    uint16_t chords[CHORD_TABLE_SIZE];
+    uint16_t modifiers[MODIFIERS_NUM];
+    uint16_t stick[STICK_DIRECTIONS_NUM]; // Left thumb-stick
+    uint16_t rstick[STICK_DIRECTIONS_NUM]; // Right thumb-stick, zero if unused
+    /* Every key that may be emitted, to be registered with UI_SET_KEYBIT */
+    uint32_t keys_num;
+    uint16_t keys[LAYOUT_KEYS_MAX];
+    /* Macro i is steps [macro_first[i], macro_first[i + 1]) */
+    uint32_t macros_num;
+    uint32_t macro_first[LAYOUT_MACROS_MAX + 1];
+    uint32_t steps_num;
+    struct layout_step steps[LAYOUT_MACRO_STEPS_MAX];
+};
+
+static inline size_t chord_index(enum side side, uint32_t keys)
+{
+    return (((size_t)side & 3) << 8) | (keys & KMASK_CHORD_KEYS);
+}
+
+/*
+ * Tells whether the chord can be entered at all: the d-pad can't point to
+ * opposite directions simultaneously and the first side is defined by the
+ * first pressed key, so at least one key of that side must be in the chord.
+ */
+static inline bool chord_reachable(enum side first, uint32_t keys)
+{
+    if (keys & ~KMASK_CHORD_KEYS)
+        return false;
+    if ((keys & (KMASK_LEFT | KMASK_RIGHT)) == (KMASK_LEFT | KMASK_RIGHT))
+        return false;
+    if ((keys & (KMASK_UP | KMASK_DOWN)) == (KMASK_UP | KMASK_DOWN))
+        return false;
+    if (first == SIDE_LEFT)
+        return (keys & KMASK_CHORD_LEFT) != 0;
+    if (first == SIDE_RIGHT)
+        return (keys & KMASK_CHORD_RIGHT) != 0;
+    return false;
+}
+
+/* Adds the key to the list of keys to register unless it is there already */
+static inline bool layout_add_key(struct layout *layout, uint16_t code)
+{
+    if (code >= LAYOUT_ACTION_FIRST)
+        return true;
+    for (uint32_t i = 0; i < layout->keys_num; i++) {
+        if (layout->keys[i] == code)
+            return true;
+    }
+    if (layout->keys_num >= LAYOUT_KEYS_MAX)
+        return false;
+    layout->keys[layout->keys_num++] = code;
+    return true;
+}
@@ -0,0 +1,884 @@
+/* SPDX-License-Identifier: Unlicense
+ */
+
+/*
+ * Layout compiler. Turns a text layout description (see layout.txt) into a
+ * binary image that main maps with the -l option, and draws a diagram of the
+ * chords, so neither of them can drift from the description. It also searches
+ * for a cheaper assignment of keys to chords given what is actually typed.
+ */
+
+#include <linux/input-event-codes.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <limits.h>
+#include <math.h>
+
+#include "telemetry.h"
+
+struct name {
+    const char *name;
+    uint16_t value;
+};
+
+#define K(name) { #name, KEY_##name }
+static const struct name g_key_names[] = {
+    K(ESC), K(1), K(2), K(3), K(4), K(5), K(6), K(7), K(8), K(9), K(0), K(MINUS), K(EQUAL),
+    K(BACKSPACE), K(TAB), K(Q), K(W), K(E), K(R), K(T), K(Y), K(U), K(I), K(O), K(P),
+    K(LEFTBRACE), K(RIGHTBRACE), K(ENTER), K(LEFTCTRL), K(A), K(S), K(D), K(F), K(G), K(H),
+    K(J), K(K), K(L), K(SEMICOLON), K(APOSTROPHE), K(GRAVE), K(LEFTSHIFT), K(BACKSLASH), K(Z),
+    K(X), K(C), K(V), K(B), K(N), K(M), K(COMMA), K(DOT), K(SLASH), K(RIGHTSHIFT),
+    K(KPASTERISK), K(LEFTALT), K(SPACE), K(CAPSLOCK), K(F1), K(F2), K(F3), K(F4), K(F5), K(F6),
+    K(F7), K(F8), K(F9), K(F10), K(NUMLOCK), K(SCROLLLOCK), K(KP7), K(KP8), K(KP9), K(KPMINUS),
+    K(KP4), K(KP5), K(KP6), K(KPPLUS), K(KP1), K(KP2), K(KP3), K(KP0), K(KPDOT),
+    K(ZENKAKUHANKAKU), K(102ND), K(F11), K(F12), K(RO), K(KATAKANA), K(HIRAGANA), K(HENKAN),
+    K(KATAKANAHIRAGANA), K(MUHENKAN), K(KPJPCOMMA), K(KPENTER), K(RIGHTCTRL), K(KPSLASH),
+    K(SYSRQ), K(RIGHTALT), K(LINEFEED), K(HOME), K(UP), K(PAGEUP), K(LEFT), K(RIGHT), K(END),
+    K(DOWN), K(PAGEDOWN), K(INSERT), K(DELETE), K(MACRO), K(MUTE), K(VOLUMEDOWN), K(VOLUMEUP),
+    K(POWER), K(KPEQUAL), K(KPPLUSMINUS), K(PAUSE), K(SCALE), K(KPCOMMA), K(HANGEUL), K(HANJA),
+    K(YEN), K(LEFTMETA), K(RIGHTMETA), K(COMPOSE), K(STOP), K(AGAIN), K(PROPS), K(UNDO),
+    K(FRONT), K(COPY), K(OPEN), K(PASTE), K(FIND), K(CUT), K(HELP), K(MENU), K(CALC), K(SETUP),
+    K(SLEEP), K(WAKEUP), K(FILE), K(SENDFILE), K(DELETEFILE), K(XFER), K(PROG1), K(PROG2),
+    K(WWW), K(MSDOS), K(COFFEE), K(ROTATE_DISPLAY), K(CYCLEWINDOWS), K(MAIL), K(BOOKMARKS),
+    K(COMPUTER), K(BACK), K(FORWARD), K(CLOSECD), K(EJECTCD), K(EJECTCLOSECD), K(NEXTSONG),
+    K(PLAYPAUSE), K(PREVIOUSSONG), K(STOPCD), K(RECORD), K(REWIND), K(PHONE), K(ISO), K(CONFIG),
+    K(HOMEPAGE), K(REFRESH), K(EXIT), K(MOVE), K(EDIT), K(SCROLLUP), K(SCROLLDOWN),
+    K(KPLEFTPAREN), K(KPRIGHTPAREN), K(NEW), K(REDO), K(F13), K(F14), K(F15), K(F16), K(F17),
+    K(F18), K(F19), K(F20), K(F21), K(F22), K(F23), K(F24), K(PLAYCD), K(PAUSECD), K(PROG3),
+    K(PROG4), K(ALL_APPLICATIONS), K(SUSPEND), K(CLOSE), K(PLAY), K(FASTFORWARD), K(BASSBOOST),
+    K(PRINT), K(HP), K(CAMERA), K(SOUND), K(QUESTION), K(EMAIL), K(CHAT), K(SEARCH), K(CONNECT),
+    K(FINANCE), K(SPORT), K(SHOP), K(ALTERASE), K(CANCEL), K(BRIGHTNESSDOWN), K(BRIGHTNESSUP),
+    K(MEDIA), K(SWITCHVIDEOMODE), K(KBDILLUMTOGGLE), K(KBDILLUMDOWN), K(KBDILLUMUP), K(SEND),
+    K(REPLY), K(FORWARDMAIL), K(SAVE), K(DOCUMENTS), K(BATTERY), K(BLUETOOTH), K(WLAN), K(UWB),
+    K(UNKNOWN), K(VIDEO_NEXT), K(VIDEO_PREV), K(BRIGHTNESS_CYCLE), K(BRIGHTNESS_AUTO),
+    K(DISPLAY_OFF), K(WWAN), K(RFKILL), K(MICMUTE),
+};
+#undef K
+
+/* Short names of the left modifiers for shortcuts like Ctrl+Shift+T */
+static const struct name g_modifier_aliases[] = {
+    { "CTRL", KEY_LEFTCTRL },
+    { "SHIFT", KEY_LEFTSHIFT },
+    { "ALT", KEY_LEFTALT },
+    { "META", KEY_LEFTMETA },
+    { "SUPER", KEY_LEFTMETA },
+};
+
+/* US layout: key and whether shift is needed for every printable character */
+static const struct {
+    uint16_t code;
+    bool shift;
+} g_chars[128] = {
+    ['\n'] = { KEY_ENTER, false }, ['\t'] = { KEY_TAB, false }, [' '] = { KEY_SPACE, false },
+    ['a'] = { KEY_A, false }, ['b'] = { KEY_B, false }, ['c'] = { KEY_C, false }, ['d'] = { KEY_D, false },
+    ['e'] = { KEY_E, false }, ['f'] = { KEY_F, false }, ['g'] = { KEY_G, false }, ['h'] = { KEY_H, false },
+    ['i'] = { KEY_I, false }, ['j'] = { KEY_J, false }, ['k'] = { KEY_K, false }, ['l'] = { KEY_L, false },
+    ['m'] = { KEY_M, false }, ['n'] = { KEY_N, false }, ['o'] = { KEY_O, false }, ['p'] = { KEY_P, false },
+    ['q'] = { KEY_Q, false }, ['r'] = { KEY_R, false }, ['s'] = { KEY_S, false }, ['t'] = { KEY_T, false },
+    ['u'] = { KEY_U, false }, ['v'] = { KEY_V, false }, ['w'] = { KEY_W, false }, ['x'] = { KEY_X, false },
+    ['y'] = { KEY_Y, false }, ['z'] = { KEY_Z, false },
+    ['A'] = { KEY_A, true }, ['B'] = { KEY_B, true }, ['C'] = { KEY_C, true }, ['D'] = { KEY_D, true },
+    ['E'] = { KEY_E, true }, ['F'] = { KEY_F, true }, ['G'] = { KEY_G, true }, ['H'] = { KEY_H, true },
+    ['I'] = { KEY_I, true }, ['J'] = { KEY_J, true }, ['K'] = { KEY_K, true }, ['L'] = { KEY_L, true },
+    ['M'] = { KEY_M, true }, ['N'] = { KEY_N, true }, ['O'] = { KEY_O, true }, ['P'] = { KEY_P, true },
+    ['Q'] = { KEY_Q, true }, ['R'] = { KEY_R, true }, ['S'] = { KEY_S, true }, ['T'] = { KEY_T, true },
+    ['U'] = { KEY_U, true }, ['V'] = { KEY_V, true }, ['W'] = { KEY_W, true }, ['X'] = { KEY_X, true },
+    ['Y'] = { KEY_Y, true }, ['Z'] = { KEY_Z, true },
+    ['1'] = { KEY_1, false }, ['2'] = { KEY_2, false }, ['3'] = { KEY_3, false }, ['4'] = { KEY_4, false },
+    ['5'] = { KEY_5, false }, ['6'] = { KEY_6, false }, ['7'] = { KEY_7, false }, ['8'] = { KEY_8, false },
+    ['9'] = { KEY_9, false }, ['0'] = { KEY_0, false },
+    ['!'] = { KEY_1, true }, ['@'] = { KEY_2, true }, ['#'] = { KEY_3, true }, ['$'] = { KEY_4, true },
+    ['%'] = { KEY_5, true }, ['^'] = { KEY_6, true }, ['&'] = { KEY_7, true }, ['*'] = { KEY_8, true },
+    ['('] = { KEY_9, true }, [')'] = { KEY_0, true },
+    ['-'] = { KEY_MINUS, false }, ['_'] = { KEY_MINUS, true }, ['='] = { KEY_EQUAL, false },
+    ['+'] = { KEY_EQUAL, true }, ['['] = { KEY_LEFTBRACE, false }, ['{'] = { KEY_LEFTBRACE, true },
+    [']'] = { KEY_RIGHTBRACE, false }, ['}'] = { KEY_RIGHTBRACE, true }, ['\\'] = { KEY_BACKSLASH, false },
+    ['|'] = { KEY_BACKSLASH, true }, [';'] = { KEY_SEMICOLON, false }, [':'] = { KEY_SEMICOLON, true },
+    ['\''] = { KEY_APOSTROPHE, false }, ['"'] = { KEY_APOSTROPHE, true }, ['`'] = { KEY_GRAVE, false },
+    ['~'] = { KEY_GRAVE, true }, [','] = { KEY_COMMA, false }, ['<'] = { KEY_COMMA, true },
+    ['.'] = { KEY_DOT, false }, ['>'] = { KEY_DOT, true }, ['/'] = { KEY_SLASH, false },
+    ['?'] = { KEY_SLASH, true },
+};
+
+/* Chord actions, written where a key name is expected */
+static const struct name g_action_names[] = {
+    { "@complete", LAYOUT_ACTION_COMPLETE },
+    { "@accept", LAYOUT_ACTION_ACCEPT },
+};
+
+static const struct name g_button_names[] = {
+    { "LEFT", KMASK_LEFT },
+    { "RIGHT", KMASK_RIGHT },
+    { "UP", KMASK_UP },
+    { "DOWN", KMASK_DOWN },
+    { "WEST", KMASK_WEST },
+    { "EAST", KMASK_EAST },
+    { "NORTH", KMASK_NORTH },
+    { "SOUTH", KMASK_SOUTH },
+};
+
+static const struct name g_modifier_names[] = {
+    { "LT", MODIFIER_LT },
+    { "RT", MODIFIER_RT },
+    { "LB", MODIFIER_LB },
+    { "RB", MODIFIER_RB },
+};
+
+static const struct name g_stick_names[] = {
+    { "LEFT", STICK_LEFT },
+    { "RIGHT", STICK_RIGHT },
+    { "UP", STICK_UP },
+    { "DOWN", STICK_DOWN },
+};
+
+/* Symbols of the buttons for the diagram, in the KMASK bits order */
+static const char *const g_button_symbols[] = {
+    "◀", "▶", "▲", "▼", "□", "○", "△", "✕",
+};
+
+#define NAMES_NUM(names) (sizeof(names) / sizeof(names[0]))
+
+static const struct name *find_name(const struct name *names, size_t num, const char *name)
+{
+    for (size_t i = 0; i < num; i++) {
+        if (strcmp(names[i].name, name) == 0)
+            return &names[i];
+    }
+    return NULL;
+}
+
+/* Source of every macro for the diagram */
+static char g_macro_labels[LAYOUT_MACROS_MAX][24];
+
+static const char *key_name(uint16_t code)
+{
+    if (code >= LAYOUT_ACTION_MACRO && code < LAYOUT_ACTION_MACRO + LAYOUT_MACROS_MAX)
+        return g_macro_labels[code - LAYOUT_ACTION_MACRO];
+    for (size_t i = 0; i < NAMES_NUM(g_action_names); i++) {
+        if (g_action_names[i].value == code)
+            return g_action_names[i].name;
+    }
+    for (size_t i = 0; i < NAMES_NUM(g_key_names); i++) {
+        if (g_key_names[i].value == code)
+            return g_key_names[i].name;
+    }
+    return "?";
+}
+
+/* Accepts key names in any case, with and without the KEY_ prefix, and actions */
+static const struct name *find_key(const char *name)
+{
+    if (name[0] == '@')
+        return find_name(g_action_names, NAMES_NUM(g_action_names), name);
+    char upper[32];
+    size_t len = 0;
+    for (; name[len] && len < sizeof(upper) - 1; len++) {
+        upper[len] = toupper((unsigned char)name[len]);
+    }
+    upper[len] = '\0';
+    name = strncmp(upper, "KEY_", 4) == 0 ? upper + 4 : upper;
+    const struct name *alias = find_name(g_modifier_aliases, NAMES_NUM(g_modifier_aliases), name);
+    return alias ? alias : find_name(g_key_names, NAMES_NUM(g_key_names), name);
+}
+
+static int g_errors = 0;
+
+static void error(const char *path, int line, const char *message, const char *token)
+{
+    fprintf(stderr, "%s:%d: %s \"%s\"\n", path, line, message, token ? token : "");
+    g_errors++;
+}
+
+static bool macro_step(struct layout *layout, uint16_t code, uint16_t value)
+{
+    if (layout->steps_num >= LAYOUT_MACRO_STEPS_MAX)
+        return false;
+    layout->steps[layout->steps_num++] = (struct layout_step){ .code = code, .value = value };
+    return code == 0 || layout_add_key(layout, code);
+}
+
+/* Every key event goes in a frame of its own, so no consumer merges them */
+static bool macro_key(struct layout *layout, uint16_t code, uint16_t value)
+{
+    return macro_step(layout, code, value) && macro_step(layout, 0, 0);
+}
+
+/*
+ * Compiles a quoted string or a shortcut like Ctrl+Shift+T into a macro and
+ * returns its chord code, zero on error.
+ */
+static uint16_t macro_compile(const char *path, int line, struct layout *layout, const char *string, char *shortcut)
+{
+    if (layout->macros_num >= LAYOUT_MACROS_MAX) {
+        error(path, line, "too many macros, failed to add", string ? string : shortcut);
+        return 0;
+    }
+    const uint32_t index = layout->macros_num;
+    snprintf(g_macro_labels[index], sizeof(g_macro_labels[index]), "%s", string ? string : shortcut);
+    bool ok = true;
+    if (string) {
+        for (const char *c = string; *c && ok; c++) {
+            if ((unsigned char)*c >= 128 || g_chars[(unsigned char)*c].code == 0) {
+                const char bad[2] = { *c, '\0' };
+                error(path, line, "character can't be typed", bad);
+                return 0;
+            }
+            const bool shift = g_chars[(unsigned char)*c].shift;
+            ok = (!shift || macro_key(layout, KEY_LEFTSHIFT, 1)) &&
+                macro_key(layout, g_chars[(unsigned char)*c].code, 1) &&
+                macro_key(layout, g_chars[(unsigned char)*c].code, 0) &&
+                (!shift || macro_key(layout, KEY_LEFTSHIFT, 0));
+        }
+    } else {
+        /* All keys but the last one are held while the last one is tapped */
+        uint16_t codes[8];
+        size_t count = 0;
+        for (char *part = strtok(shortcut, "+"); part; part = strtok(NULL, "+")) {
+            const struct name *key = find_key(part);
+            if (key == NULL || key->value >= LAYOUT_ACTION_FIRST || count == 8) {
+                error(path, line, "bad key in shortcut", part);
+                return 0;
+            }
+            codes[count++] = key->value;
+        }
+        for (size_t i = 0; i < count && ok; i++) {
+            ok = macro_key(layout, codes[i], 1);
+        }
+        for (size_t i = count; i > 0 && ok; i--) {
+            ok = macro_key(layout, codes[i - 1], 0);
+        }
+    }
+    if (!ok) {
+        error(path, line, "macro doesn't fit, too many steps or keys", g_macro_labels[index]);
+        return 0;
+    }
+    layout->macro_first[++layout->macros_num] = layout->steps_num;
+    return LAYOUT_ACTION_MACRO + index;
+}
+
+/* Parses "A+B+C" into a keys mask, returns zero on error */
+static uint32_t parse_buttons(char *buttons)
+{
+    uint32_t keys = 0;
+    for (char *button = strtok(buttons, "+"); button; button = strtok(NULL, "+")) {
+        const struct name *name = find_name(g_button_names, NAMES_NUM(g_button_names), button);
+        if (name == NULL)
+            return 0;
+        keys |= name->value;
+    }
+    return keys;
+}
+
+/* Unescapes \n, \t, \\ and \" in place */
+static void unescape(char *string)
+{
+    char *to = string;
+    for (const char *from = string; *from; from++) {
+        if (*from == '\\' && from[1]) {
+            from++;
+            *to++ = *from == 'n' ? '\n' : *from == 't' ? '\t' : *from;
+        } else {
+            *to++ = *from;
+        }
+    }
+    *to = '\0';
+}
+
+static void parse_line(const char *path, int line, char *text, struct layout *layout, int *sources)
+{
+    /* A quoted string may only be the last thing in a line, comments follow it */
+    char *string = strpbrk(text, "\"#");
+    if (string && *string == '"') {
+        char *end = string + 1;
+        while (*end && *end != '"')
+            end += end[0] == '\\' && end[1] ? 2 : 1;
+        if (*end != '"')
+            return error(path, line, "unterminated string", string);
+        const char *rest = end + 1 + strspn(end + 1, " \t\r\n");
+        if (*rest != '\0' && *rest != '#')
+            return error(path, line, "unexpected text after string", rest);
+        *string++ = '\0';
+        *end = '\0';
+        unescape(string);
+    } else {
+        if (string)
+            *string = '\0';
+        string = NULL;
+    }
+    char *words[6];
+    size_t count = 0;
+    for (char *word = strtok(text, " \t\r\n"); word && count < 6; word = strtok(NULL, " \t\r\n")) {
+        words[count++] = word;
+    }
+    if (count == 0)
+        return;
+    if (string && !(strcmp(words[0], "chord") == 0 && count == 4 && strcmp(words[3], "=") == 0))
+        return error(path, line, "strings are allowed only as chord values, near", words[0]);
+    if (strcmp(words[0], "chord") == 0 && count == (string ? 4 : 5) && strcmp(words[3], "=") == 0) {
+        enum side first = SIDE_NO;
+        if (strcmp(words[1], "left") == 0)
+            first = SIDE_LEFT;
+        else if (strcmp(words[1], "right") == 0)
+            first = SIDE_RIGHT;
+        else
+            return error(path, line, "first side must be \"left\" or \"right\", got", words[1]);
+        const char *value = string ? string : words[4];
+        const uint32_t keys = parse_buttons(words[2]);
+        if (keys == 0)
+            return error(path, line, "unknown button in", words[2]);
+        if (!chord_reachable(first, keys))
+            return error(path, line, "chord is unreachable, key", value);
+        const size_t index = chord_index(first, keys);
+        if (layout->chords[index]) {
+            fprintf(stderr, "%s:%d: chord duplicates the one at line %d\n", path, line, sources[index]);
+            g_errors++;
+            return;
+        }
+        uint16_t code = 0;
+        if (string || strchr(words[4], '+')) {
+            code = macro_compile(path, line, layout, string, words[4]);
+            if (code == 0)
+                return;
+        } else {
+            const struct name *key = find_key(words[4]);
+            if (key == NULL)
+                return error(path, line, "unknown key", words[4]);
+            code = key->value;
+            if (!layout_add_key(layout, code))
+                error(path, line, "too many keys, failed to add", words[4]);
+        }
+        layout->chords[index] = code;
+        sources[index] = line;
+    } else if (strcmp(words[0], "modifier") == 0 && count == 4 && strcmp(words[2], "=") == 0) {
+        const struct name *modifier = find_name(g_modifier_names, NAMES_NUM(g_modifier_names), words[1]);
+        const struct name *key = find_key(words[3]);
+        if (modifier == NULL)
+            return error(path, line, "unknown modifier", words[1]);
+        if (key == NULL)
+            return error(path, line, "unknown key", words[3]);
+        layout->modifiers[modifier->value] = key->value;
+        if (!layout_add_key(layout, key->value))
+            error(path, line, "too many keys, failed to add", words[3]);
+    } else if ((strcmp(words[0], "stick") == 0 || strcmp(words[0], "rstick") == 0) &&
+            count == 4 && strcmp(words[2], "=") == 0) {
+        const struct name *direction = find_name(g_stick_names, NAMES_NUM(g_stick_names), words[1]);
+        const struct name *key = find_key(words[3]);
+        if (direction == NULL)
+            return error(path, line, "unknown stick direction", words[1]);
+        if (key == NULL)
+            return error(path, line, "unknown key", words[3]);
+        if (words[0][0] == 'r')
+            layout->rstick[direction->value] = key->value;
+        else
+            layout->stick[direction->value] = key->value;
+        if (!layout_add_key(layout, key->value))
+            error(path, line, "too many keys, failed to add", words[3]);
+    } else if (strcmp(words[0], "key") == 0 && count == 2) {
+        const struct name *key = find_key(words[1]);
+        if (key == NULL)
+            return error(path, line, "unknown key", words[1]);
+        if (!layout_add_key(layout, key->value))
+            error(path, line, "too many keys, failed to add", words[1]);
+    } else {
+        error(path, line, "syntax error near", words[0]);
+    }
+}
+
+static int compile(const char *path, struct layout *layout)
+{
+    FILE *input = fopen(path, "r");
+    if (input == NULL) {
+        fprintf(stderr, "\"%s\": ", path);
+        perror("fopen");
+        return 1;
+    }
+    memset(layout, 0, sizeof(*layout));
+    memcpy(layout->magic, LAYOUT_MAGIC, sizeof(layout->magic));
+    layout->version = LAYOUT_VERSION;
+    layout->size = sizeof(*layout);
+    static int sources[CHORD_TABLE_SIZE];
+    char text[256];
+    for (int line = 1; fgets(text, sizeof(text), input); line++) {
+        parse_line(path, line, text, layout, sources);
+    }
+    fclose(input);
+    for (size_t i = 0; i < MODIFIERS_NUM; i++) {
+        if (layout->modifiers[i] == 0)
+            error(path, 0, "modifier is not assigned:", g_modifier_names[i].name);
+    }
+    for (size_t i = 0; i < STICK_DIRECTIONS_NUM; i++) {
+        if (layout->stick[i] == 0)
+            error(path, 0, "stick direction is not assigned:", g_stick_names[i].name);
+    }
+    return g_errors != 0;
+}
+
+static void buttons_label(uint32_t keys, char *label, size_t size)
+{
+    label[0] = '\0';
+    for (size_t i = 0; i < 8; i++) {
+        if (keys & (1u << i))
+            strncat(label, g_button_symbols[i], size - strlen(label) - 1);
+    }
+    if (label[0] == '\0')
+        snprintf(label, size, "-");
+}
+
+/* Macros are arbitrary text, which may clash with the markup */
+static void svg_escape(const char *text, FILE *svg)
+{
+    for (; *text; text++) {
+        if (*text == '<')
+            fputs("&lt;", svg);
+        else if (*text == '>')
+            fputs("&gt;", svg);
+        else if (*text == '&')
+            fputs("&amp;", svg);
+        else if (*text == '\n')
+            fputs("\\n", svg);
+        else
+            fputc(*text, svg);
+    }
+}
+
+/*
+ * Draws a table for every first side: rows are the buttons of the first side,
+ * columns are the buttons of the other side and cells are the resulting keys.
+ */
+static void draw_diagram(const struct layout *layout, FILE *svg)
+{
+    enum { CELL_W = 96, CELL_H = 28, HEADER_W = 72, GAP = 40 };
+    uint32_t rows[2][256], columns[2][256];
+    size_t rows_num[2] = {0}, columns_num[2] = {0};
+    for (size_t s = 0; s < 2; s++) {
+        const enum side first = s == 0 ? SIDE_LEFT : SIDE_RIGHT;
+        const uint32_t own = first == SIDE_LEFT ? KMASK_CHORD_LEFT : KMASK_CHORD_RIGHT;
+        bool row_seen[256] = {false}, column_seen[256] = {false};
+        for (uint32_t keys = 0; keys < 256; keys++) {
+            if (layout->chords[chord_index(first, keys)] == 0)
+                continue;
+            row_seen[keys & own] = true;
+            column_seen[keys & ~own & KMASK_CHORD_KEYS] = true;
+        }
+        for (uint32_t keys = 0; keys < 256; keys++) {
+            if (row_seen[keys])
+                rows[s][rows_num[s]++] = keys;
+            if (column_seen[keys])
+                columns[s][columns_num[s]++] = keys;
+        }
+    }
+    const size_t width0 = HEADER_W + columns_num[0] * CELL_W;
+    const size_t width1 = HEADER_W + columns_num[1] * CELL_W;
+    const size_t width = (width0 > width1 ? width0 : width1) + 2 * GAP;
+    const size_t height = (rows_num[0] + rows_num[1] + 4) * CELL_H + 3 * GAP;
+    fprintf(svg, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+    fprintf(svg, "<!-- Generated by layoutc, do not edit -->\n");
+    fprintf(svg, "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"%zu\" height=\"%zu\" "
+            "font-family=\"sans-serif\" font-size=\"13\">\n", width, height);
+    fprintf(svg, "<rect width=\"100%%\" height=\"100%%\" fill=\"white\"/>\n");
+    size_t y = GAP;
+    for (size_t s = 0; s < 2; s++) {
+        const enum side first = s == 0 ? SIDE_LEFT : SIDE_RIGHT;
+        fprintf(svg, "<text x=\"%d\" y=\"%zu\" font-weight=\"bold\">%s side first</text>\n",
+                GAP, y + CELL_H / 2, first == SIDE_LEFT ? "Left" : "Right");
+        y += CELL_H;
+        char label[64];
+        for (size_t c = 0; c < columns_num[s]; c++) {
+            buttons_label(columns[s][c], label, sizeof(label));
+            fprintf(svg, "<text x=\"%zu\" y=\"%zu\" text-anchor=\"middle\">%s</text>\n",
+                    GAP + HEADER_W + c * CELL_W + CELL_W / 2, y + CELL_H * 2 / 3, label);
+        }
+        y += CELL_H;
+        for (size_t r = 0; r < rows_num[s]; r++, y += CELL_H) {
+            buttons_label(rows[s][r], label, sizeof(label));
+            fprintf(svg, "<text x=\"%d\" y=\"%zu\">%s</text>\n", GAP, y + CELL_H * 2 / 3, label);
+            for (size_t c = 0; c < columns_num[s]; c++) {
+                const uint16_t code = layout->chords[chord_index(first, rows[s][r] | columns[s][c])];
+                const size_t x = GAP + HEADER_W + c * CELL_W;
+                fprintf(svg, "<rect x=\"%zu\" y=\"%zu\" width=\"%d\" height=\"%d\" fill=\"%s\" stroke=\"#999\"/>\n",
+                        x, y, CELL_W, CELL_H, code ? "#eef" : "#f8f8f8");
+                if (code) {
+                    fprintf(svg, "<text x=\"%zu\" y=\"%zu\" text-anchor=\"middle\">",
+                            x + CELL_W / 2, y + CELL_H * 2 / 3);
+                    svg_escape(key_name(code), svg);
+                    fprintf(svg, "</text>\n");
+                }
+            }
+        }
+        y += GAP;
+    }
+    fprintf(svg, "</svg>\n");
+}
+
+/*
+ * The optimizer moves the keys of the characters, but digits, between the
+ * chords they occupy, looking for the lowest effort to type the corpus and
+ * the measured sessions. The effort of a chord is its number of buttons, plus
+ * a penalty for two buttons on one side, or its entry time measured by main
+ * converted to buttons. Consecutive chords starting on the same side are
+ * penalized too, as the same hand has to start both.
+ */
+#define OPT_KEYS_MAX 96
+#define OPT_ITERATIONS 400000
+#define OPT_DOUBLE_COST 0.5 // Per side with two buttons pressed
+#define OPT_SAME_SIDE_COST 0.25
+#define OPT_MEASURED_MIN 5 // Commits needed to trust the measured entry time
+#define OPT_TEMPERATURE_START 0.05
+#define OPT_TEMPERATURE_END 0.0005
+
+static size_t g_opt_keys_num = 0;
+static uint16_t g_opt_codes[OPT_KEYS_MAX];
+static size_t g_opt_slots[OPT_KEYS_MAX]; // Chord indexes the keys can be moved between
+static double g_opt_freq[OPT_KEYS_MAX];
+static double g_opt_pairs[OPT_KEYS_MAX][OPT_KEYS_MAX];
+/* Nonzero g_opt_pairs, so scoring doesn't walk the whole matrix */
+static struct {
+    uint8_t a, b;
+    double count;
+} g_opt_sequences[OPT_KEYS_MAX * OPT_KEYS_MAX];
+static size_t g_opt_sequences_num = 0;
+static double g_opt_sequences_total = 0;
+static double g_opt_chars = 0;
+static double g_opt_cost[CHORD_TABLE_SIZE];
+static double g_opt_measured_ns[CHORD_TABLE_SIZE]; // Zero if not measured
+
+static int opt_key(uint16_t code)
+{
+    for (size_t k = 0; k < g_opt_keys_num; k++) {
+        if (g_opt_codes[k] == code)
+            return k;
+    }
+    return -1;
+}
+
+static bool opt_movable(uint16_t code)
+{
+    for (int c = 0; c < 128; c++) {
+        if (g_chars[c].code == code && !g_chars[c].shift && !isdigit(c))
+            return true;
+    }
+    return false;
+}
+
+static size_t opt_buttons(size_t index, uint32_t side_mask)
+{
+    return __builtin_popcount(index & side_mask);
+}
+
+static void opt_collect(const struct layout *layout)
+{
+    for (size_t index = 0; index < CHORD_TABLE_SIZE; index++) {
+        const uint16_t code = layout->chords[index];
+        if (code == 0 || code >= LAYOUT_ACTION_FIRST || !opt_movable(code) || opt_key(code) != -1)
+            continue;
+        if (g_opt_keys_num == OPT_KEYS_MAX)
+            break;
+        g_opt_slots[g_opt_keys_num] = index;
+        g_opt_codes[g_opt_keys_num++] = code;
+    }
+}
+
+/* Characters without a movable key break sequences */
+static int opt_read_corpus(const char *path)
+{
+    FILE *corpus = fopen(path, "r");
+    if (corpus == NULL) {
+        fprintf(stderr, "\"%s\": ", path);
+        perror("fopen");
+        return 1;
+    }
+    int previous = -1;
+    for (int c; (c = fgetc(corpus)) != EOF;) {
+        const int k = c < 128 && g_chars[c].code ? opt_key(g_chars[c].code) : -1;
+        if (k != -1) {
+            g_opt_freq[k]++;
+            g_opt_chars++;
+            if (previous != -1)
+                g_opt_pairs[previous][k]++;
+        }
+        previous = k;
+    }
+    fclose(corpus);
+    return 0;
+}
+
+/* Takes chord counts and entry times from a page left by main -p capture -T page */
+static int opt_read_telemetry(const char *path)
+{
+    static struct telemetry page;
+    FILE *input = fopen(path, "rb");
+    if (input == NULL) {
+        fprintf(stderr, "\"%s\": ", path);
+        perror("fopen");
+        return 1;
+    }
+    const size_t read = fread(&page, sizeof(page), 1, input);
+    fclose(input);
+    if (read != 1 || memcmp(page.magic, TELEMETRY_MAGIC, sizeof(page.magic)) != 0 ||
+            page.version != TELEMETRY_VERSION || page.size != sizeof(page)) {
+        fprintf(stderr, "\"%s\": not a telemetry page of version %d\n", path, TELEMETRY_VERSION);
+        return 1;
+    }
+    for (size_t index = 0; index < CHORD_TABLE_SIZE; index++) {
+        const uint64_t hits = page.stats.chord_hits[index];
+        if (hits == 0)
+            continue;
+        const int k = opt_key(page.chords[index]);
+        if (k != -1) {
+            g_opt_freq[k] += hits;
+            g_opt_chars += hits;
+        }
+        if (hits >= OPT_MEASURED_MIN)
+            g_opt_measured_ns[index] = (double)page.stats.chord_entry_ns[index] / hits;
+    }
+    return 0;
+}
+
+/* Lists the sequences and weighs every chord, once all input is read */
+static void opt_prepare(void)
+{
+    for (size_t a = 0; a < g_opt_keys_num; a++) {
+        for (size_t b = 0; b < g_opt_keys_num; b++) {
+            if (g_opt_pairs[a][b] == 0)
+                continue;
+            g_opt_sequences[g_opt_sequences_num].a = a;
+            g_opt_sequences[g_opt_sequences_num].b = b;
+            g_opt_sequences[g_opt_sequences_num++].count = g_opt_pairs[a][b];
+            g_opt_sequences_total += g_opt_pairs[a][b];
+        }
+    }
+    double measured_ns = 0, measured_buttons = 0;
+    for (size_t index = 0; index < CHORD_TABLE_SIZE; index++) {
+        const size_t left = opt_buttons(index, KMASK_CHORD_LEFT);
+        const size_t right = opt_buttons(index, KMASK_CHORD_RIGHT);
+        g_opt_cost[index] = left + right + OPT_DOUBLE_COST * ((left >= 2) + (right >= 2));
+        if (g_opt_measured_ns[index]) {
+            measured_ns += g_opt_measured_ns[index];
+            measured_buttons += g_opt_cost[index];
+        }
+    }
+    /* Measured times are scaled to the same units as the rest */
+    for (size_t index = 0; index < CHORD_TABLE_SIZE && measured_ns > 0; index++) {
+        if (g_opt_measured_ns[index])
+            g_opt_cost[index] = g_opt_measured_ns[index] * measured_buttons / measured_ns;
+    }
+}
+
+struct opt_score {
+    double effort; // Per character
+    double same_side; // Share of sequences starting on the same side
+    double doubles; // Share of characters typed with two buttons on a side
+};
+
+/* slot_of[k] is the index in g_opt_slots the key k is in */
+static struct opt_score opt_score(const size_t *slot_of)
+{
+    struct opt_score score = {0};
+    for (size_t a = 0; a < g_opt_keys_num; a++) {
+        const size_t index = g_opt_slots[slot_of[a]];
+        score.effort += g_opt_freq[a] * g_opt_cost[index];
+        if (opt_buttons(index, KMASK_CHORD_LEFT) >= 2 || opt_buttons(index, KMASK_CHORD_RIGHT) >= 2)
+            score.doubles += g_opt_freq[a];
+    }
+    for (size_t i = 0; i < g_opt_sequences_num; i++) {
+        if ((g_opt_slots[slot_of[g_opt_sequences[i].a]] >> 8) == (g_opt_slots[slot_of[g_opt_sequences[i].b]] >> 8))
+            score.same_side += g_opt_sequences[i].count;
+    }
+    score.effort = (score.effort + OPT_SAME_SIDE_COST * score.same_side) / g_opt_chars;
+    score.same_side = g_opt_sequences_total ? score.same_side / g_opt_sequences_total : 0;
+    score.doubles /= g_opt_chars;
+    return score;
+}
+
+static void opt_print(const char *name, struct opt_score score)
+{
+    printf("%s: %.3f buttons per character, %.1f%% same side sequences, %.1f%% double chords\n",
+            name, score.effort, score.same_side * 100, score.doubles * 100);
+}
+
+static uint64_t opt_random(void)
+{
+    static uint64_t state = 0x9e3779b97f4a7c15;
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+/* Simulated annealing over swaps of two keys, returns the best assignment found */
+static void opt_anneal(size_t *slot_of)
+{
+    static size_t best[OPT_KEYS_MAX];
+    memcpy(best, slot_of, g_opt_keys_num * sizeof(best[0]));
+    double current = opt_score(slot_of).effort, best_effort = current;
+    for (size_t i = 0; i < OPT_ITERATIONS && g_opt_keys_num > 1; i++) {
+        const double temperature = OPT_TEMPERATURE_START *
+            pow(OPT_TEMPERATURE_END / OPT_TEMPERATURE_START, (double)i / OPT_ITERATIONS);
+        const size_t a = opt_random() % g_opt_keys_num, b = opt_random() % g_opt_keys_num;
+        if (a == b)
+            continue;
+        size_t swap = slot_of[a];
+        slot_of[a] = slot_of[b];
+        slot_of[b] = swap;
+        const double next = opt_score(slot_of).effort;
+        if (next <= current || exp((current - next) / temperature) * UINT64_MAX > (double)opt_random()) {
+            current = next;
+            if (current < best_effort) {
+                best_effort = current;
+                memcpy(best, slot_of, g_opt_keys_num * sizeof(best[0]));
+            }
+        } else {
+            slot_of[b] = slot_of[a];
+            slot_of[a] = swap;
+        }
+    }
+    memcpy(slot_of, best, g_opt_keys_num * sizeof(best[0]));
+}
+
+/* Copies the description, with the chords of the moved keys changed */
+static int opt_write(const char *source_path, const char *path, const size_t *slot_of)
+{
+    uint16_t chords[CHORD_TABLE_SIZE] = {0};
+    for (size_t k = 0; k < g_opt_keys_num; k++) {
+        chords[g_opt_slots[slot_of[k]]] = g_opt_codes[k];
+    }
+    FILE *input = fopen(source_path, "r");
+    FILE *output = fopen(path, "w");
+    if (input == NULL || output == NULL) {
+        fprintf(stderr, "\"%s\": ", input ? path : source_path);
+        perror("fopen");
+        return 1;
+    }
+    char text[256];
+    while (fgets(text, sizeof(text), input)) {
+        char copy[256];
+        memcpy(copy, text, sizeof(copy));
+        const char *words[5];
+        size_t count = 0;
+        for (char *word = strtok(copy, " \t\r\n"); word && count < 5; word = strtok(NULL, " \t\r\n")) {
+            words[count++] = word;
+        }
+        if (count == 5 && strcmp(words[0], "chord") == 0 && strcmp(words[3], "=") == 0) {
+            char buttons[64];
+            snprintf(buttons, sizeof(buttons), "%s", words[2]);
+            const enum side first = strcmp(words[1], "left") == 0 ? SIDE_LEFT : SIDE_RIGHT;
+            const size_t index = chord_index(first, parse_buttons(buttons));
+            if (chords[index]) {
+                fprintf(output, "chord %s %s = %s\n", words[1], words[2], key_name(chords[index]));
+                continue;
+            }
+        }
+        fputs(text, output);
+    }
+    fclose(input);
+    if (ferror(output) || fclose(output) != 0) {
+        fprintf(stderr, "\"%s\": ", path);
+        perror("write");
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *image_path = NULL;
+    const char *diagram_path = NULL;
+    const char *optimized_path = NULL;
+    const char *corpus_paths[16];
+    size_t corpus_num = 0;
+    const char *telemetry_paths[16];
+    size_t telemetry_num = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "o:d:O:c:m:")) != -1) {
+        switch (opt) {
+        case 'o':
+            image_path = optarg;
+            break;
+        case 'd':
+            diagram_path = optarg;
+            break;
+        case 'O':
+            optimized_path = optarg;
+            break;
+        case 'c':
+            if (corpus_num < sizeof(corpus_paths) / sizeof(corpus_paths[0]))
+                corpus_paths[corpus_num++] = optarg;
+            break;
+        case 'm':
+            if (telemetry_num < sizeof(telemetry_paths) / sizeof(telemetry_paths[0]))
+                telemetry_paths[telemetry_num++] = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-o image] [-d diagram.svg] <layout.txt>\n"
+                    "       %s -O optimized.txt [-c corpus.txt]... [-m telemetry page]... <layout.txt>\n",
+                    argv[0], argv[0]);
+            exit(1);
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "Error: No layout description specified\n");
+        exit(1);
+    }
+    static struct layout layout;
+    if (compile(argv[optind], &layout) != 0)
+        exit(1);
+    if (image_path) {
+        /*
+         * The new image is renamed over the old one, so a running main that
+         * watches it never sees a partly written file.
+         */
+        char tmp_path[PATH_MAX];
+        snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", image_path);
+        FILE *image = fopen(tmp_path, "wb");
+        if (image == NULL || fwrite(&layout, sizeof(layout), 1, image) != 1 || fclose(image) != 0) {
+            fprintf(stderr, "\"%s\": ", tmp_path);
+            perror("write");
+            exit(1);
+        }
+        if (rename(tmp_path, image_path) == -1) {
+            fprintf(stderr, "\"%s\": ", image_path);
+            perror("rename");
+            unlink(tmp_path);
+            exit(1);
+        }
+    }
+    if (diagram_path) {
+        FILE *svg = fopen(diagram_path, "w");
+        if (svg == NULL) {
+            fprintf(stderr, "\"%s\": ", diagram_path);
+            perror("fopen");
+            exit(1);
+        }
+        draw_diagram(&layout, svg);
+        fclose(svg);
+    }
+    if (optimized_path) {
+        opt_collect(&layout);
+        for (size_t i = 0; i < corpus_num; i++) {
+            if (opt_read_corpus(corpus_paths[i]) != 0)
+                exit(1);
+        }
+        for (size_t i = 0; i < telemetry_num; i++) {
+            if (opt_read_telemetry(telemetry_paths[i]) != 0)
+                exit(1);
+        }
+        if (g_opt_chars == 0) {
+            fprintf(stderr, "Error: Nothing to optimize for, give a corpus or a telemetry page\n");
+            exit(1);
+        }
+        opt_prepare();
+        size_t slot_of[OPT_KEYS_MAX];
+        for (size_t k = 0; k < g_opt_keys_num; k++) {
+            slot_of[k] = k;
+        }
+        opt_print("Current", opt_score(slot_of));
+        opt_anneal(slot_of);
+        opt_print("Optimized", opt_score(slot_of));
+        if (opt_write(argv[optind], optimized_path, slot_of) != 0)
+            exit(1);
+    }
+    return 0;
+}
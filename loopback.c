@@ -0,0 +1,587 @@
+/* SPDX-License-Identifier: Unlicense
+ */
+
+/*
+ * Loopback rig. Creates a fake DS4 gamepad through uinput with the very
+ * capabilities the udev script and -m check for, runs main against it and
+ * reads the virtual keyboard back through evdev, so the whole binary is
+ * exercised with no hardware: grab(), the mode switch and the uinput output.
+ * It checks that every chord types its key, measures the latency from the
+ * committing release to the key press arriving and finds the highest rate of
+ * chords main keeps up with. Captures given as arguments are fed to the pad
+ * at their recorded pace and checked against an in-process replay.
+ *
+ * main.c is built in for its tables, layout loading and replay, like bench.c.
+ * It needs read-write access to /dev/uinput and read access to the event
+ * nodes, root is not required. The rig grabs the virtual keyboard, so the keys
+ * it types reach nobody else.
+ */
+
+#define main ds4_main
+#include "main.c"
+#undef main
+
+#include <poll.h>
+#include <sys/wait.h>
+
+#define LOOPBACK_KEYS_MAX 65536
+#define LOOPBACK_WAIT_NS (3 * UINT64_C(1000000000)) // For devices to appear and keys to arrive
+#define LOOPBACK_LATENCY_MAX_NS (20 * UINT64_C(1000000)) // p99 at a sustained rate
+#define DS4_PRODUCT 0x05c4
+
+struct keystroke {
+    uint16_t code;
+    uint64_t ns; // CLOCK_MONOTONIC
+};
+
+static const char *g_main_path = "./main";
+static const char *g_layout_arg = NULL;
+static int g_pad_fd = -1;
+static int g_probe_fd = -1; // A reader of the pad, which gets nothing while main grabs it
+static uint32_t g_probe_scan = 0;
+static char g_pad_path[PATH_MAX];
+static pid_t g_main_pid = -1;
+static bool g_main_repeats = true;
+static int g_keyboard_fd = -1;
+static char g_keyboard_name[UINPUT_MAX_NAME_SIZE];
+
+/* Key presses read back from the virtual keyboard by the collector thread */
+static struct keystroke g_received[LOOPBACK_KEYS_MAX];
+static atomic_size_t g_received_num = 0;
+static atomic_bool g_collect_stop = false;
+static pthread_t g_collector;
+
+/* Release times of the chords and the keys they are expected to type */
+static struct keystroke g_expected[LOOPBACK_KEYS_MAX];
+static size_t g_expected_num = 0;
+
+static void sleep_until(uint64_t deadline_ns)
+{
+    const struct timespec ts = {
+        .tv_sec = deadline_ns / 1000000000,
+        .tv_nsec = deadline_ns % 1000000000,
+    };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+static void pad_write(const struct input_event *events, size_t count)
+{
+    if (write(g_pad_fd, events, count * sizeof(events[0])) != (ssize_t)(count * sizeof(events[0]))) {
+        perror("write(/dev/uinput)");
+        exit(1);
+    }
+}
+
+/* Writes the events followed by SYN_REPORT as one frame */
+static void pad_frame(const struct input_event *events, size_t count)
+{
+    struct input_event frame[16];
+    if (count >= sizeof(frame) / sizeof(frame[0]))
+        count = sizeof(frame) / sizeof(frame[0]) - 1;
+    memcpy(frame, events, count * sizeof(events[0]));
+    frame[count++] = (struct input_event){ .type = EV_SYN, .code = SYN_REPORT };
+    pad_write(frame, count);
+}
+
+static void pad_create(void)
+{
+    static const uint16_t keys[] = {
+        BTN_SOUTH, BTN_EAST, BTN_NORTH, BTN_WEST, BTN_TL, BTN_TR, BTN_TL2,
+        BTN_TR2, BTN_SELECT, BTN_START, BTN_MODE, BTN_THUMBL, BTN_THUMBR,
+    };
+    g_pad_fd = open("/dev/uinput", O_WRONLY | O_CLOEXEC);
+    if (g_pad_fd == -1) {
+        fprintf(stderr, "\"/dev/uinput\": ");
+        perror("open");
+        exit(1);
+    }
+    ioctl(g_pad_fd, UI_SET_EVBIT, EV_KEY);
+    ioctl(g_pad_fd, UI_SET_EVBIT, EV_ABS);
+    ioctl(g_pad_fd, UI_SET_EVBIT, EV_MSC);
+    ioctl(g_pad_fd, UI_SET_MSCBIT, MSC_SCAN);
+    for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+        ioctl(g_pad_fd, UI_SET_KEYBIT, keys[i]);
+    }
+    for (uint16_t code = 0; code < ABS_CNT; code++) {
+        const bool hat = code == ABS_HAT0X || code == ABS_HAT0Y;
+        if (code > ABS_RZ && !hat)
+            continue;
+        const bool trigger = code == ABS_Z || code == ABS_RZ;
+        const struct uinput_abs_setup setup = {
+            .code = code,
+            .absinfo = {
+                .minimum = hat ? -1 : 0,
+                .maximum = hat ? 1 : 255,
+                .value = hat || trigger ? 0 : 128,
+            },
+        };
+        ioctl(g_pad_fd, UI_SET_ABSBIT, code);
+        ioctl(g_pad_fd, UI_ABS_SETUP, &setup);
+    }
+    struct uinput_setup usetup = {
+        .id = { .bustype = BUS_USB, .vendor = DS4_VENDOR, .product = DS4_PRODUCT, .version = 0x8111 },
+    };
+    snprintf(usetup.name, sizeof(usetup.name), "Sony Computer Entertainment Wireless Controller");
+    if (ioctl(g_pad_fd, UI_DEV_SETUP, &usetup) == -1 || ioctl(g_pad_fd, UI_DEV_CREATE) == -1) {
+        perror("ioctl(UI_DEV_CREATE)");
+        exit(1);
+    }
+    char sysname[64] = "";
+    if (ioctl(g_pad_fd, UI_GET_SYSNAME(sizeof(sysname)), sysname) == -1) {
+        perror("ioctl(UI_GET_SYSNAME)");
+        exit(1);
+    }
+    char sys_path[PATH_MAX];
+    snprintf(sys_path, sizeof(sys_path), "/sys/devices/virtual/input/%s", sysname);
+    g_pad_path[0] = '\0';
+    for (const uint64_t deadline = monotonic_ns() + LOOPBACK_WAIT_NS; monotonic_ns() < deadline; usleep(10000)) {
+        DIR *dir = opendir(sys_path);
+        for (struct dirent *entry; dir && (entry = readdir(dir));) {
+            if (strncmp(entry->d_name, "event", 5) == 0)
+                snprintf(g_pad_path, sizeof(g_pad_path), "/dev/input/%s", entry->d_name);
+        }
+        if (dir)
+            closedir(dir);
+        if (g_pad_path[0] && access(g_pad_path, R_OK) == 0)
+            break;
+    }
+    if (!g_pad_path[0] || access(g_pad_path, R_OK) != 0) {
+        fprintf(stderr, "Error: event node of the fake gamepad hasn't appeared, is udev or devtmpfs there?\n");
+        exit(1);
+    }
+    g_probe_fd = open(g_pad_path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (g_probe_fd == -1) {
+        fprintf(stderr, "\"%s\": ", g_pad_path);
+        perror("open");
+        exit(1);
+    }
+    /* Sticks centered, in case the kernel doesn't take the initial values */
+    const struct input_event center[] = {
+        { .type = EV_ABS, .code = ABS_X, .value = 128 },
+        { .type = EV_ABS, .code = ABS_Y, .value = 128 },
+        { .type = EV_ABS, .code = ABS_RX, .value = 128 },
+        { .type = EV_ABS, .code = ABS_RY, .value = 128 },
+    };
+    pad_frame(center, sizeof(center) / sizeof(center[0]));
+}
+
+static void pad_destroy(void)
+{
+    close(g_probe_fd);
+    ioctl(g_pad_fd, UI_DEV_DESTROY);
+    close(g_pad_fd);
+}
+
+/*
+ * Tells if main holds the grab on the pad, which it takes in keyboard mode.
+ * Taking the grab to find out would make main fail to take it, so the pad
+ * sends a scan code that main ignores and the probe reader gets it only if
+ * the pad isn't grabbed.
+ */
+static bool pad_grabbed(void)
+{
+    struct input_event events[64];
+    while (read(g_probe_fd, events, sizeof(events)) > 0)
+        ;
+    const struct input_event scan = { .type = EV_MSC, .code = MSC_SCAN, .value = ++g_probe_scan };
+    pad_frame(&scan, 1);
+    struct pollfd pfd = { .fd = g_probe_fd, .events = POLLIN };
+    return poll(&pfd, 1, 20) == 0;
+}
+
+static void *collector(void *_arg)
+{
+    (void) _arg;
+    struct input_event events[64];
+    while (!atomic_load(&g_collect_stop)) {
+        struct pollfd pfd = { .fd = g_keyboard_fd, .events = POLLIN };
+        if (poll(&pfd, 1, 50) <= 0)
+            continue;
+        const ssize_t len = read(g_keyboard_fd, events, sizeof(events));
+        for (ssize_t i = 0; i < len / (ssize_t)sizeof(events[0]); i++) {
+            const size_t num = atomic_load(&g_received_num);
+            if (events[i].type != EV_KEY || events[i].value != 1 || num == LOOPBACK_KEYS_MAX)
+                continue;
+            g_received[num] = (struct keystroke){ .code = events[i].code, .ns = timeval_ns(events[i].time) };
+            atomic_store(&g_received_num, num + 1);
+        }
+    }
+    return NULL;
+}
+
+static void press_mode(void)
+{
+    struct input_event ev = { .type = EV_KEY, .code = BTN_MODE, .value = 1 };
+    pad_frame(&ev, 1);
+    ev.value = 0;
+    pad_frame(&ev, 1);
+}
+
+/*
+ * Taps the PS button until main takes or drops the grab, which also tells
+ * that it has attached the pad. Returns false if it never does.
+ */
+static bool mode_switch(bool keyboard_mode)
+{
+    for (const uint64_t deadline = monotonic_ns() + LOOPBACK_WAIT_NS; monotonic_ns() < deadline;) {
+        press_mode();
+        usleep(50000);
+        if (pad_grabbed() == keyboard_mode)
+            return true;
+    }
+    return false;
+}
+
+/* Starts main on the pad and waits for its keyboard, leaves it in gamepad mode */
+static void rig_start(void)
+{
+    snprintf(g_keyboard_name, sizeof(g_keyboard_name), "DS4 loopback %d", (int)getpid());
+    const char *argv[12] = { g_main_path, "-v", "0", "-N", g_keyboard_name };
+    size_t argc = 5;
+    if (g_layout_arg) {
+        argv[argc++] = "-l";
+        argv[argc++] = g_layout_arg;
+    }
+    /* Repeats hinge on exact timing, so captures are fed without them */
+    if (!g_main_repeats) {
+        argv[argc++] = "-D";
+        argv[argc++] = "0";
+    }
+    argv[argc++] = g_pad_path;
+    g_main_pid = fork();
+    if (g_main_pid == -1) {
+        perror("fork");
+        exit(1);
+    }
+    if (g_main_pid == 0) {
+        const int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDOUT_FILENO);
+        execv(g_main_path, (char *const *)argv);
+        fprintf(stderr, "\"%s\": ", g_main_path);
+        perror("execv");
+        _exit(127);
+    }
+    const uint64_t deadline = monotonic_ns() + LOOPBACK_WAIT_NS;
+    while (g_keyboard_fd == -1 && monotonic_ns() < deadline) {
+        usleep(10000);
+        DIR *dir = opendir("/dev/input");
+        for (struct dirent *entry; dir && g_keyboard_fd == -1 && (entry = readdir(dir));) {
+            if (strncmp(entry->d_name, "event", 5) != 0)
+                continue;
+            char path[PATH_MAX], name[UINPUT_MAX_NAME_SIZE] = "";
+            snprintf(path, sizeof(path), "/dev/input/%s", entry->d_name);
+            const int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+            if (fd != -1 && ioctl(fd, EVIOCGNAME(sizeof(name)), name) >= 0 && strcmp(name, g_keyboard_name) == 0)
+                g_keyboard_fd = fd;
+            else if (fd != -1)
+                close(fd);
+        }
+        if (dir)
+            closedir(dir);
+    }
+    /* Nothing else sees what the rig types then, not even a desktop on the host */
+    if (g_keyboard_fd != -1 && ioctl(g_keyboard_fd, EVIOCGRAB, (void *)1) == -1) {
+        perror("ioctl(EVIOCGRAB)");
+        kill(g_main_pid, SIGKILL);
+        exit(1);
+    }
+    if (g_keyboard_fd == -1 || !mode_switch(true) || !mode_switch(false)) {
+        fprintf(stderr, "Error: main hasn't %s in time\n",
+                g_keyboard_fd == -1 ? "created its keyboard" : "switched the pad between modes");
+        kill(g_main_pid, SIGKILL);
+        exit(1);
+    }
+    int clockid = CLOCK_MONOTONIC;
+    ioctl(g_keyboard_fd, EVIOCSCLOCKID, &clockid);
+    /* Drops whatever the mode switches have typed, nothing is expected */
+    struct input_event drain[64];
+    while (read(g_keyboard_fd, drain, sizeof(drain)) > 0)
+        ;
+    atomic_store(&g_received_num, 0);
+    atomic_store(&g_collect_stop, false);
+    pthread_create(&g_collector, NULL, collector, NULL);
+}
+
+static void rig_stop(void)
+{
+    atomic_store(&g_collect_stop, true);
+    pthread_join(g_collector, NULL);
+    kill(g_main_pid, SIGINT);
+    waitpid(g_main_pid, NULL, 0);
+    close(g_keyboard_fd);
+    g_keyboard_fd = -1;
+}
+
+/* Waits for count key presses to arrive, returns how many did */
+static size_t wait_received(size_t count)
+{
+    const uint64_t deadline = monotonic_ns() + LOOPBACK_WAIT_NS;
+    while (atomic_load(&g_received_num) < count && monotonic_ns() < deadline)
+        usleep(1000);
+    /* Anything extra would come right after */
+    usleep(20000);
+    return atomic_load(&g_received_num);
+}
+
+/* Compares the received keys to the expected ones, printing the first mismatch */
+static bool check_received(const char *name, const struct keystroke *expected, size_t expected_num)
+{
+    const size_t received = atomic_load(&g_received_num);
+    for (size_t i = 0; i < expected_num && i < received; i++) {
+        if (g_received[i].code != expected[i].code) {
+            printf("%s: key %zu is %u instead of %u\n", name, i, g_received[i].code, expected[i].code);
+            return false;
+        }
+    }
+    if (received != expected_num) {
+        printf("%s: %zu keys typed instead of %zu\n", name, received, expected_num);
+        return false;
+    }
+    return true;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    const uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Latency from the committing release to the key press, returns the p99 */
+static uint64_t report_latency(const char *name, double rate)
+{
+    static uint64_t latencies[LOOPBACK_KEYS_MAX];
+    if (g_expected_num == 0) {
+        printf("%-24s no keys typed\n", name);
+        return 0;
+    }
+    for (size_t i = 0; i < g_expected_num; i++) {
+        latencies[i] = g_received[i].ns > g_expected[i].ns ? g_received[i].ns - g_expected[i].ns : 0;
+    }
+    qsort(latencies, g_expected_num, sizeof(latencies[0]), compare_u64);
+    const uint64_t p99 = latencies[g_expected_num * 99 / 100];
+    printf("%-24s %8.0f keys/sec  latency us: p50 %.1f  p90 %.1f  p99 %.1f  max %.1f\n",
+            name, rate,
+            latencies[g_expected_num * 50 / 100] / 1e3,
+            latencies[g_expected_num * 90 / 100] / 1e3,
+            p99 / 1e3,
+            latencies[g_expected_num - 1] / 1e3);
+    return p99;
+}
+
+/* Press events of the chord, the buttons of the first side go first */
+static size_t chord_events(size_t index, struct input_event *events)
+{
+    const enum side first = index >> 8;
+    const uint32_t keys = index & KMASK_CHORD_KEYS;
+    size_t count = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        for (size_t i = 0; i < INPUT_CLASSES_NUM; i++) {
+            const struct input_class *input = &g_inputs[i];
+            if (input->kind != INPUT_CHORD || (input->side == first) != (pass == 0))
+                continue;
+            for (int positive = 0; positive < 2; positive++) {
+                if (!(keys & input->mask[positive]))
+                    continue;
+                const bool key = i < INPUT_KEYS_NUM;
+                events[count++] = (struct input_event){
+                    .type = key ? EV_KEY : EV_ABS,
+                    .code = key ? BTN_SOUTH + i : i - INPUT_KEYS_NUM,
+                    .value = key || positive ? 1 : -1,
+                };
+                /* Buttons have the same mask for both values */
+                if (key)
+                    break;
+            }
+        }
+    }
+    return count;
+}
+
+/*
+ * Types count chords of the layout in turn at the rate, every chord pressed
+ * at once and released at once. Zero rate sends them as fast as possible.
+ */
+static bool type_chords(const char *name, unsigned rate, size_t count, uint64_t *p99)
+{
+    static size_t indexes[CHORD_TABLE_SIZE];
+    size_t indexes_num = 0;
+    for (size_t index = 0; index < CHORD_TABLE_SIZE; index++) {
+        const uint16_t code = g_layout->chords[index];
+        if (code && code < LAYOUT_ACTION_FIRST)
+            indexes[indexes_num++] = index;
+    }
+    if (indexes_num == 0) {
+        printf("%s: the layout has no chords that type a key\n", name);
+        return false;
+    }
+    if (count > LOOPBACK_KEYS_MAX)
+        count = LOOPBACK_KEYS_MAX;
+    atomic_store(&g_received_num, 0);
+    g_expected_num = 0;
+    const uint64_t interval_ns = rate ? UINT64_C(1000000000) / rate : 0;
+    const uint64_t start_ns = monotonic_ns();
+    for (size_t i = 0; i < count; i++) {
+        const size_t index = indexes[i % indexes_num];
+        struct input_event events[8];
+        const size_t events_num = chord_events(index, events);
+        pad_frame(events, events_num);
+        sleep_until(start_ns + i * interval_ns + interval_ns / 2);
+        for (size_t e = 0; e < events_num; e++) {
+            events[e].value = 0;
+        }
+        g_expected[g_expected_num++] = (struct keystroke){ .code = g_layout->chords[index], .ns = monotonic_ns() };
+        pad_frame(events, events_num);
+        sleep_until(start_ns + (i + 1) * interval_ns);
+    }
+    const uint64_t sent_ns = monotonic_ns() - start_ns;
+    wait_received(g_expected_num);
+    if (!check_received(name, g_expected, g_expected_num))
+        return false;
+    const uint64_t last_ns = g_received[g_expected_num - 1].ns;
+    const double elapsed_ns = last_ns > start_ns ? last_ns - start_ns : sent_ns;
+    *p99 = report_latency(name, g_expected_num * 1e9 / elapsed_ns);
+    return true;
+}
+
+/* Feeds a single gamepad capture at its own pace, checking it against replay */
+static bool feed_capture(const char *path)
+{
+    struct capture_record *records;
+    struct input_event *events;
+    size_t events_num;
+    const ssize_t count = replay_load(path, &records, &events, &events_num);
+    if (count == -1)
+        return false;
+    for (ssize_t i = 0; i < count; i++) {
+        if (records[i].type == CAPTURE_UNIQ) {
+            i += (records[i].code + sizeof(records[0]) - 1) / sizeof(records[0]);
+            continue;
+        }
+        if (records[i].controller != 0 || records[i].type == CAPTURE_HIDRAW_REPORT || g_controllers[0].touchpad) {
+            printf("%s: only captures of a single evdev gamepad can be fed to the pad\n", path);
+            return false;
+        }
+    }
+    g_repeat_delay_ms = 0;
+    replay_feed(records, events, 0, count);
+    chord_window_expire(&g_controllers[0], UINT64_MAX);
+    output_flush(&g_outputs[0]);
+    static struct keystroke expected[LOOPBACK_KEYS_MAX];
+    size_t expected_num = 0;
+    for (size_t i = 0; i < g_outputs[0].sink_len && expected_num < LOOPBACK_KEYS_MAX; i++) {
+        const struct input_event ev = g_outputs[0].sink[i];
+        if (ev.type == EV_KEY && ev.value == 1)
+            expected[expected_num++] = (struct keystroke){ .code = ev.code };
+    }
+
+    g_main_repeats = false;
+    rig_start();
+    g_main_repeats = true;
+    uint64_t at_ns = monotonic_ns();
+    size_t frame = 0;
+    for (ssize_t i = 0; i < count; i++) {
+        at_ns += (uint64_t)records[i].delta_us * 1000;
+        /* The pad has a uniq of its own, the recorded one is only for replay */
+        if (records[i].type == CAPTURE_UNIQ) {
+            i += (records[i].code + sizeof(records[0]) - 1) / sizeof(records[0]);
+            frame = i + 1;
+            continue;
+        }
+        if (events[i].type != EV_SYN || events[i].code != SYN_REPORT)
+            continue;
+        sleep_until(at_ns);
+        pad_write(&events[frame], i + 1 - frame);
+        frame = i + 1;
+    }
+    wait_received(expected_num);
+    const bool ok = check_received(path, expected, expected_num);
+    rig_stop();
+    if (ok)
+        printf("%-24s %zu keys typed as replayed\n", path, expected_num);
+    free(g_outputs[0].sink);
+    memset(&g_outputs[0], 0, sizeof(g_outputs[0]));
+    g_outputs[0].fd = -1;
+    memset(g_controllers, 0, sizeof(g_controllers));
+    free(records);
+    free(events);
+    return ok;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *layout_path = NULL;
+    unsigned rate = 20;
+    size_t count = 0;
+    bool sweep = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "M:l:r:n:s")) != -1) {
+        switch (opt) {
+        case 'M':
+            g_main_path = optarg;
+            break;
+        case 'l':
+            layout_path = optarg;
+            break;
+        case 'r':
+            rate = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            count = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            sweep = true;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-M main] [-l layout] [-r chords per sec] [-n chords] [-s] [capture]...\n",
+                    argv[0]);
+            exit(1);
+        }
+    }
+    g_verbosity = 0;
+    for (size_t i = 0; i < CONTROLLERS_MAX; i++) {
+        g_outputs[i].fd = -1;
+    }
+    build_builtin_layout();
+    if (layout_path) {
+        struct keymap *keymap = keymap_load(layout_path);
+        if (keymap == NULL)
+            exit(1);
+        keymap_use(keymap);
+        g_layout_arg = layout_path;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    pad_create();
+    bool ok = true;
+    rig_start();
+    if (!mode_switch(true)) {
+        printf("Mode switch: the pad hasn't been grabbed in keyboard mode\n");
+        ok = false;
+    }
+    uint64_t p99;
+    size_t chords_num = 0;
+    for (size_t index = 0; index < CHORD_TABLE_SIZE; index++) {
+        chords_num += g_layout->chords[index] && g_layout->chords[index] < LAYOUT_ACTION_FIRST;
+    }
+    ok = type_chords("chords", rate, count ? count : chords_num, &p99) && ok;
+    /* Doubles the rate while main keeps up with it */
+    unsigned sustained = 0;
+    for (unsigned r = 50; sweep && r <= 6400; r *= 2) {
+        char name[32];
+        snprintf(name, sizeof(name), "sweep %u/s", r);
+        if (!type_chords(name, r, r / 2 > chords_num ? r / 2 : chords_num, &p99) || p99 > LOOPBACK_LATENCY_MAX_NS)
+            break;
+        sustained = r;
+    }
+    if (sweep)
+        printf("Highest sustained rate: %u chords/sec\n", sustained);
+    rig_stop();
+
+    for (int i = optind; i < argc; i++) {
+        ok = feed_capture(argv[i]) && ok;
+    }
+    pad_destroy();
+    printf("%s\n", ok ? "All checks passed" : "Some checks failed");
+    return ok ? 0 : 1;
+}
@@ -1,6 +1,8 @@
 /* SPDX-License-Identifier: Unlicense
  */
 
+#define _GNU_SOURCE // pthread_setaffinity_np, RUSAGE_THREAD
+
 #include <linux/uinput.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -11,8 +13,35 @@
 #include <stdbool.h>
 #include <signal.h>
 #include <inttypes.h>
+#include <sys/time.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/netlink.h>
+#include <linux/hidraw.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/timerfd.h>
+#include <sys/inotify.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <sched.h>
+#include <stdarg.h>
+#ifdef USE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+#include "layout.h"
+#include "dict.h"
+#include "telemetry.h"
 
-// TODO Impl repeating key when right thumb-stick tilted enough in any way
 // TODO Impl switching between keyboard and regular mode by BTN_MODE (the PS key)
 
 /* Analog Binarization Threshold */
@@ -29,57 +58,328 @@ enum mapping_type {
     MT_DOUBLE_DOUBLE = 5,
 };
 
-enum side {
-    SIDE_NO = 0,
-    SIDE_LEFT = 1,
-    SIDE_RIGHT = 2,
-};
-
 struct mapping {
     enum side first;
     uint32_t keys;
     uint16_t code;
 };
 
-enum keys_mask {
-    KMASK_LEFT = 1 << 0,
-    KMASK_RIGHT = 1 << 1,
-    KMASK_UP = 1 << 2,
-    KMASK_DOWN = 1 << 3,
-    KMASK_WEST = 1 << 4,
-    KMASK_EAST = 1 << 5,
-    KMASK_NORTH = 1 << 6,
-    KMASK_SOUTH = 1 << 7,
-    KMASK_LT = 1 << 8,
-    KMASK_LB = 1 << 9,
-    KMASK_RT = 1 << 10,
-    KMASK_RB = 1 << 11,
-    KMASK_OPTIONS = 1 << 12,
-    KMASK_SHARE = 1 << 13,
-    KMASK_PS = 1 << 14,
-    KMASK_THUMBL = 1 << 15,
-    KMASK_THUMBR = 1 << 16,
-    KMASK_THUMBL_DOWN = 1 << 17,
-    KMASK_THUMBL_UP = 1 << 18,
-    KMASK_THUMBL_LEFT = 1 << 19,
-    KMASK_THUMBL_RIGHT = 1 << 20,
-    KMASK_THUMBR_DOWN = 1 << 21,
-    KMASK_THUMBR_UP = 1 << 22,
-    KMASK_THUMBR_LEFT = 1 << 23,
-    KMASK_THUMBR_RIGHT = 1 << 24,
-    KMASK_PRESSED = 1 << 29,
-    KMASK_SIDE_SHIFT = 30,
-    KMASK_CHORD_KEYS =
-        KMASK_RIGHT | KMASK_LEFT | KMASK_UP | KMASK_DOWN | KMASK_WEST |
-        KMASK_EAST | KMASK_NORTH | KMASK_SOUTH,
-};
-
 struct state {
     uint32_t keys; // keys_mask
     bool keyboard_mode;
+    bool chord_repeated; // Held chord has been repeated, don't commit on release
+    /* Chord window mode: chord keys pressed since the window has opened */
+    enum side window_side;
+    uint32_t window_keys;
+    uint64_t window_ns; // Deadline on the event clock, zero if no window is open
+    uint64_t chord_ns; // Event time of the first press of the chord being formed
+};
+
+/* What a gamepad input is to the state machine, see g_inputs */
+enum input_kind {
+    INPUT_NONE = 0,
+    INPUT_CHORD = 1, // Takes part in chords, sets KMASK_PRESSED while held
+    INPUT_MODIFIER = 2, // Holds the modifier key of the layout
+    INPUT_STICK = 3, // Binarized stick axis, taps the key of the layout on tilt
+    INPUT_FLAG = 4, // Only tracked in state.keys
+    INPUT_MODE = 5, // Toggles the keyboard mode
+};
+
+struct input_class {
+    uint8_t kind; // input_kind
+    uint8_t side; // Side of a chord input
+    uint8_t modifier;
+    bool rstick; // Right stick, its keys are in layout.rstick
+    uint8_t direction[2]; // Stick direction for negative and positive values
+    uint32_t mask[2]; // KMASK bits for negative and positive values, the same for keys
+};
+
+#define EVENTS_BUF_SIZE 64
+#define FRAME_MAX 64
+
+/*
+ * Batched evdev reader. Events are accumulated until SYN_REPORT and then
+ * processed as a whole frame. The last seen key and axis values are mirrored
+ * to be able to resync after SYN_DROPPED.
+ */
+struct reader {
+    int fd;
+    clockid_t clockid; // Clock used by the kernel for event timestamps
+    struct input_event buf[EVENTS_BUF_SIZE];
+    struct input_event frame[FRAME_MAX];
+    size_t frame_len;
+    bool dropped;
+    uint8_t keys[KEY_CNT / 8 + 1];
+    int32_t abs[ABS_CNT];
+};
+
+enum trace_kind {
+    TRACE_IN = 0,
+    TRACE_OUT = 1,
+    TRACE_SIDE = 2,
+    TRACE_CHORD = 3,
+    TRACE_MODE = 4,
+    TRACE_RESYNC = 5,
+};
+
+/* Fixed-size binary trace record, formatted to text by the drainer thread */
+struct trace_record {
+    uint64_t timestamp_ns; // CLOCK_MONOTONIC
+    uint32_t keys; // state.keys at the moment of recording
+    int32_t value;
+    uint16_t type;
+    uint16_t code;
+    uint16_t chord; // chord_index() of the committed chord
+    uint8_t kind; // trace_kind
+};
+
+/* Must be a power of two */
+#define TRACE_RING_SIZE 4096
+
+/*
+ * Single producer single consumer ring. The event loop is the only producer
+ * and the drainer thread is the only consumer, so no locks are needed.
+ */
+struct trace_ring {
+    _Atomic size_t head;
+    _Atomic size_t tail;
+    _Atomic size_t dropped;
+    struct trace_record records[TRACE_RING_SIZE];
+};
+
+/* Enough for a whole accepted word with a space, four events per key tap */
+#define OUTPUT_MAX (4 * (DICT_WORD_MAX + 1) + 16)
+
+/* Word mode: the letters of the word being typed into the output */
+struct word_state {
+    char text[DICT_WORD_MAX];
+    uint32_t len;
+    uint32_t overflow; // Letters typed past DICT_WORD_MAX, such a word is never completed
+    uint32_t prefix_len; // Letters typed by hand, the rest is the offered completion
+    uint32_t candidate; // Offered dict_node.top index plus one, zero if none
+};
+
+#ifdef USE_IO_URING
+/* Events of one output that a single io_uring write request can carry */
+#define URING_WRITE_MAX 1024
+#endif
+
+/* Events emitted while handling one input frame, flushed with a single write */
+struct output {
+    int fd;
+    struct input_event buf[OUTPUT_MAX];
+    size_t len;
+    struct word_state word;
+    bool unsynced;
+    uint64_t commit_ns; // Time of the earliest chord commit not written yet
+    /* In-memory sink used instead of the fd by the replay mode */
+    struct input_event *sink;
+    size_t sink_len;
+    size_t sink_cap;
+#ifdef USE_IO_URING
+    /* One buffer is being written by the ring while the other one fills up */
+    struct input_event ring_buf[2][URING_WRITE_MAX];
+    size_t ring_len[2];
+    int ring_staging; // Index of the buffer that fills up
+    bool ring_in_flight;
+    uint64_t ring_commit_ns; // commit_ns of the buffer in flight
+#endif
+};
+
+#define CONTROLLERS_MAX 8
+/* Controllers plus the uevent socket and whatever else the loop waits on */
+#define EPOLL_EVENTS_MAX (CONTROLLERS_MAX + 4)
+#define UEVENT_BUF_SIZE 4096
+/* Nodes udev hasn't given access to yet, retried with a doubling backoff */
+#define PENDING_MAX 8
+#define PENDING_FIRST_NS (50 * UINT64_C(1000000))
+#define PENDING_ATTEMPTS 7 // About 3 seconds in total
+
+#define DS4_VENDOR 0x054c
+#define HIDRAW_REPORT_MAX 128
+
+/* Controller state decoded from a raw DS4 input report */
+struct ds4_input {
+    uint8_t axes[4]; // ABS_X, ABS_Y, ABS_RX, ABS_RY
+    int8_t hat_x;
+    int8_t hat_y;
+    uint16_t buttons; // Bit per g_ds4_buttons entry
+};
+
+#define STICK_AXES_NUM 4
+#define CALIBRATIONS_MAX 32
+/* How long sticks must be left alone at the start of calibration */
+#define CALIBRATION_CENTER_NS (2 * UINT64_C(1000000000))
+
+/* Measured stick geometry of a particular controller, axes as in g_stick_axes */
+struct calibration {
+    char uniq[32]; // Bluetooth MAC, as reported by EVIOCGUNIQ
+    uint8_t center[STICK_AXES_NUM];
+    uint8_t min[STICK_AXES_NUM];
+    uint8_t max[STICK_AXES_NUM];
+    uint8_t dead_zone; // Radius in normalized units, see stick_norm
+};
+
+/* Calibration mode measurements */
+struct calibration_sampler {
+    uint64_t start_ns; // Zero until the first frame
+    bool rotating; // Centering phase is over
+    uint32_t count;
+    uint32_t sum[STICK_AXES_NUM];
+    uint8_t center_min[STICK_AXES_NUM];
+    uint8_t center_max[STICK_AXES_NUM];
+    uint8_t min[STICK_AXES_NUM];
+    uint8_t max[STICK_AXES_NUM];
+};
+
+/* Touchpad to pointer translation, gains are in 1/256 pixel per touchpad unit */
+#define TOUCH_SLOTS 2
+#define TOUCH_GAIN 96
+#define TOUCH_ACCEL 12 // Extra gain per touchpad unit of motion in a frame
+#define TOUCH_GAIN_MAX 1024
+#define TOUCH_SCROLL_STEP 64 // Two-finger motion per wheel click
+
+struct touch_slot {
+    bool down;
+    bool fresh; // Just touched, there is no previous position yet
+    int32_t x, y;
+    int32_t prev_x, prev_y;
+};
+
+/*
+ * Multitouch state of a touchpad node. Samples only update it, the pointer is
+ * moved once per frame by the whole accumulated motion.
+ */
+struct touchpad {
+    struct touch_slot slots[TOUCH_SLOTS];
+    int32_t slot; // Current ABS_MT_SLOT
+    int fingers; // Fingers down in the previous frame
+    bool button; // Touchpad is pressed down
+    uint16_t click; // Button being held on the output, zero if none
+    int32_t remainder_x, remainder_y; // Sub-pixel motion carried over
+    int32_t scroll_x, scroll_y; // Scroll motion that hasn't made a click yet
+    uint32_t samples; // Position samples in the current frame
+};
+
+#define REPEATS_MAX 16
+
+/*
+ * Key being auto-repeated. Every tilted stick direction and the held chord of
+ * every controller may have one.
+ */
+struct repeat {
+    struct controller *ctl; // NULL if the slot is free
+    uint32_t mask; // Stick direction KMASK bit, or KMASK_PRESSED for the chord
+    uint16_t axis; // Axis to scale the rate with, ABS_CNT if none
+    uint16_t code;
+    uint64_t next_ns;
+};
+
+#define CAPTURE_MAGIC "DS4CAP01"
+/*
+ * Record type for raw hidraw reports, the code is the report length. The
+ * report itself follows the record, padded to the record size.
+ */
+#define CAPTURE_HIDRAW_REPORT 0xffff
+/*
+ * Record type for the uniq of a controller, written when it is attached so
+ * replay picks the same calibration. Padded the same way, the code is its
+ * length.
+ */
+#define CAPTURE_UNIQ 0xfffe
+
+struct capture_header {
+    char magic[8];
+    uint64_t start_us; // Timestamp of the first record
+};
+
+/* Raw evdev event as recorded by the -r option */
+struct capture_record {
+    uint32_t delta_us; // Time since the previous record
+    uint16_t type;
+    uint16_t code;
+    int32_t value;
+    uint16_t controller; // Index of the controller in g_controllers
+    uint16_t reserved;
+};
+
+/* Per controller context, every controller has its own chord state */
+struct controller {
+    bool used;
+    bool grab_failed; // Detached by the event loop after the current frame
+    char path[128];
+    struct reader reader;
+    struct state state;
+    struct output *out;
+    struct calibration calibration;
+    /* Stick axis value normalized to -127..127 around the calibrated center */
+    int8_t stick_norm[STICK_AXES_NUM][256];
+    /* Binarized axis state for [axis][current state + 1][value] */
+    int8_t stick_next[STICK_AXES_NUM][3][256];
+    int8_t stick_state[STICK_AXES_NUM];
+    struct calibration_sampler sampler;
+    /* Touchpad node, its keyboard_mode tells if it drives the pointer */
+    bool touchpad;
+    char hid[64]; // HID device of the node in sysfs, shared by a gamepad and its touchpad
+    struct touchpad touch;
+    /* Reading raw HID reports from hidraw instead of evdev events */
+    bool hidraw;
+    bool hid_valid; // hid_previous holds a decoded report
+    struct ds4_input hid_previous;
+};
+
+#define MAPPINGS_NUM 106
+#ifdef USE_IO_URING
+#define URING_ENTRIES 64
+#define URING_COMPLETIONS_MAX (2 * URING_ENTRIES) // The CQ ring size, see uring_setup()
+
+enum uring_kind {
+    URING_IGNORE = 0, // Cancellations and polls linked ahead of reads
+    URING_READ = 1, // Controller input, the index is the controller
+    URING_WRITE = 2, // uinput output, the index is the output
+    URING_TIMER = 3,
+    URING_UEVENT = 4,
+};
+
+/* Kind, controller generation and index packed into the user_data */
+#define URING_DATA(kind, gen, index) ((uint64_t)(kind) << 56 | (uint64_t)(gen) << 16 | (index))
+#define URING_KIND(data) ((data) >> 56)
+#define URING_GEN(data) ((uint32_t)((data) >> 16))
+#define URING_INDEX(data) ((data) & 0xffff)
+
+/*
+ * io_uring event loop, driven by hand without liburing. Reads of the
+ * controllers, the repeat timerfd and a poll of the uevent socket stay posted,
+ * and the writes queued while handling their completions go to the kernel
+ * along with re-posting them in a single io_uring_enter(2).
+ */
+struct uring {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_local_tail; // Includes the entries not handed to the kernel yet
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    bool fixed; // Reader buffers are registered
+    bool poll_first; // The kernel doesn't poll O_NONBLOCK files by itself
+    bool read_posted[CONTROLLERS_MAX];
+    /* Bumped on detach, so late completions don't hit a reused slot */
+    uint32_t generation[CONTROLLERS_MAX];
+    bool timer_posted;
+    uint64_t timer_expirations;
+    bool uevent_posted;
+    /* Completions except writes, handled by the loop after reaping */
+    struct io_uring_cqe completions[URING_COMPLETIONS_MAX];
+    size_t completions_num;
+    uint64_t enters;
 };
+#endif
 
-#define MAPPINGS_NUM 105
 static struct mapping g_mapping[MAPPINGS_NUM] = {
     /* Right single */
     { .first = SIDE_RIGHT,  .keys = KMASK_WEST,     .code = KEY_BACKSPACE },
@@ -158,12 +458,14 @@ static struct mapping g_mapping[MAPPINGS_NUM] = {
     { .first = SIDE_LEFT,   .keys = KMASK_RIGHT | KMASK_UP | KMASK_WEST,   .code = KEY_GRAVE },
     { .first = SIDE_LEFT,   .keys = KMASK_RIGHT | KMASK_UP | KMASK_SOUTH,  .code = KEY_BACKSLASH },
     { .first = SIDE_LEFT,   .keys = KMASK_RIGHT | KMASK_UP | KMASK_NORTH,  .code = KEY_SLASH },
-    // { .first = SIDE_LEFT,   .keys = KMASK_RIGHT | KMASK_UP | KMASK_EAST,   .code = KEY_ },
+    { .first = SIDE_LEFT,   .keys = KMASK_RIGHT | KMASK_UP | KMASK_EAST,   .code = LAYOUT_ACTION_COMPLETE },
     /* Right double to left double */
     { .first = SIDE_RIGHT,  .keys = KMASK_EAST | KMASK_NORTH | KMASK_LEFT | KMASK_DOWN,     .code = KEY_INSERT },
     { .first = SIDE_RIGHT,  .keys = KMASK_EAST | KMASK_NORTH | KMASK_UP | KMASK_LEFT,       .code = KEY_SCROLLLOCK },
     { .first = SIDE_RIGHT,  .keys = KMASK_EAST | KMASK_NORTH | KMASK_DOWN | KMASK_RIGHT,    .code = KEY_PAUSE },
     { .first = SIDE_RIGHT,  .keys = KMASK_EAST | KMASK_NORTH | KMASK_RIGHT | KMASK_UP,      .code = KEY_SYSRQ },
+    /* Word mode */
+    { .first = SIDE_RIGHT,  .keys = KMASK_NORTH | KMASK_SOUTH | KMASK_UP,   .code = LAYOUT_ACTION_ACCEPT },
     /* Implicily used modifiers and other keys that must be registered via ioctl(UI_SET_EVBIT) */
     { .first = SIDE_NO,     .keys = 0,  .code = KEY_LEFTSHIFT },
     { .first = SIDE_NO,     .keys = 0,  .code = KEY_RIGHTSHIFT },
@@ -179,46 +481,579 @@ static struct mapping g_mapping[MAPPINGS_NUM] = {
     { .first = SIDE_NO,     .keys = 0,  .code = KEY_DOWN },
 };
 
-static bool g_should_stop = false;
-static int g_ifd = -1;
-struct state g_state = {0};
+/*
+ * Layout built from g_mapping at startup, used unless a compiled layout image
+ * is loaded with the -l option.
+ */
+static struct layout g_builtin_layout;
+static const struct layout *g_layout = &g_builtin_layout;
+
+/*
+ * Word dictionary mapped with the -w option, word mode is off without it.
+ * The arrays point into the image right after the header.
+ */
+static const struct dict_header *g_dict = NULL;
+static const struct dict_node *g_dict_nodes;
+static const struct dict_edge *g_dict_edges;
+static const struct dict_word *g_dict_words;
+static const char *g_dict_text;
+
+/* A layout with its macros expanded, replaced as a whole on reload */
+struct keymap {
+    struct layout layout; // A private copy, the file may change under it
+    struct keymap *next; // In g_keymaps_retired
+    /* Macros expanded into events ready to be written as is */
+    struct input_event macro_events[LAYOUT_MACRO_STEPS_MAX];
+};
+
+/*
+ * Keymap of the -l layout, NULL for the builtin one. The layout file is
+ * watched, a new version is prepared by the watcher thread and passed in
+ * g_keymap_pending, the input thread takes it between frames and passes the
+ * one it has been using back in g_keymaps_retired to be freed.
+ */
+static struct keymap *g_keymap = NULL;
+static _Atomic(struct keymap *) g_keymap_pending = NULL;
+static _Atomic(struct keymap *) g_keymaps_retired = NULL;
+static const struct input_event *g_macro_events = NULL;
+static int g_layout_watch_fd = -1;
+/* Keys registered with every output device, taken by reloaded layouts */
+static uint8_t g_output_keys[KEY_CNT / 8];
+/*
+ * Identity of the virtual keyboard. It is created once and outlives the
+ * controllers, so it stays the same device for the desktop across reconnects.
+ */
+static const char *g_output_name = "Example device";
+static uint16_t g_output_vendor = 0x1234;
+static uint16_t g_output_product = 0x5678;
+/* Touchpads drive a pointer on the virtual keyboard, enabled by the -M option */
+static bool g_touchpad_mode = false;
+/* Delay between frames of a macro, for consumers that drop fast input */
+static uint32_t g_macro_pace_us = 0;
+
+/* Realtime mode, enabled by the -t option */
+#define RT_STACK_PREFAULT (256 * 1024)
+static int g_rt_priority = 0; // SCHED_FIFO priority of the event loop
+static int g_rt_cpu = -1; // CPU to pin the event loop to, -1 for any
+static struct rusage g_rt_usage; // Page faults are counted from here
+
+/*
+ * Steady-state path checks, built in by "make main-rtcheck". Allocations and
+ * stdio calls made while handling input are caught with the linker's --wrap
+ * and reported along with the other stats.
+ */
+#ifdef RTCHECK
+static __thread bool g_steady = false;
+static uint64_t g_steady_violations = 0;
+static const char *g_steady_violation = NULL;
+#define STEADY_BEGIN() (g_steady = true)
+#define STEADY_END() (g_steady = false)
+
+static void steady_violation(const char *what)
+{
+    if (!g_steady)
+        return;
+    if (g_steady_violations++ == 0)
+        g_steady_violation = what;
+}
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t num, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+size_t __real_fwrite(const void *ptr, size_t size, size_t num, FILE *stream);
+int __real_fputs(const char *s, FILE *stream);
+int __real_fputc(int c, FILE *stream);
+int __real_puts(const char *s);
+int __real_putchar(int c);
+void __real_perror(const char *s);
+
+void *__wrap_malloc(size_t size) { steady_violation("malloc"); return __real_malloc(size); }
+void *__wrap_calloc(size_t num, size_t size) { steady_violation("calloc"); return __real_calloc(num, size); }
+void *__wrap_realloc(void *ptr, size_t size) { steady_violation("realloc"); return __real_realloc(ptr, size); }
+size_t __wrap_fwrite(const void *ptr, size_t size, size_t num, FILE *stream)
+{
+    steady_violation("fwrite");
+    return __real_fwrite(ptr, size, num, stream);
+}
+int __wrap_fputs(const char *s, FILE *stream) { steady_violation("fputs"); return __real_fputs(s, stream); }
+int __wrap_fputc(int c, FILE *stream) { steady_violation("fputc"); return __real_fputc(c, stream); }
+int __wrap_puts(const char *s) { steady_violation("puts"); return __real_puts(s); }
+int __wrap_putchar(int c) { steady_violation("putchar"); return __real_putchar(c); }
+void __wrap_perror(const char *s) { steady_violation("perror"); __real_perror(s); }
+
+int __wrap_printf(const char *format, ...)
+{
+    steady_violation("printf");
+    va_list args;
+    va_start(args, format);
+    const int ret = vprintf(format, args);
+    va_end(args);
+    return ret;
+}
+
+int __wrap_fprintf(FILE *stream, const char *format, ...)
+{
+    steady_violation("fprintf");
+    va_list args;
+    va_start(args, format);
+    const int ret = vfprintf(stream, format, args);
+    va_end(args);
+    return ret;
+}
+#else
+#define STEADY_BEGIN() ((void)0)
+#define STEADY_END() ((void)0)
+#endif
+
+static const uint16_t g_letter_keys[26] = {
+    KEY_A, KEY_B, KEY_C, KEY_D, KEY_E, KEY_F, KEY_G, KEY_H, KEY_I, KEY_J, KEY_K, KEY_L, KEY_M,
+    KEY_N, KEY_O, KEY_P, KEY_Q, KEY_R, KEY_S, KEY_T, KEY_U, KEY_V, KEY_W, KEY_X, KEY_Y, KEY_Z,
+};
+
+/* DS4 buttons in the order of their bits in the input report */
+static const uint16_t g_ds4_buttons[] = {
+    BTN_WEST, BTN_SOUTH, BTN_EAST, BTN_NORTH, BTN_TL, BTN_TR, BTN_TL2, BTN_TR2,
+    BTN_SELECT, BTN_START, BTN_THUMBL, BTN_THUMBR, BTN_MODE,
+};
+
+/* Stick axes, every pair of them is a single stick */
+static const uint16_t g_stick_axes[STICK_AXES_NUM] = { ABS_X, ABS_Y, ABS_RX, ABS_RY };
+
+/*
+ * Every gamepad button and axis by (type, code): the buttons are contiguous
+ * from BTN_SOUTH to BTN_THUMBR and the axes from ABS_X to ABS_HAT0Y.
+ */
+#define INPUT_KEYS_NUM (BTN_THUMBR - BTN_SOUTH + 1)
+#define INPUT_KEY(code) ((code) - BTN_SOUTH)
+#define INPUT_ABS(code) (INPUT_KEYS_NUM + (code))
+#define INPUT_CLASSES_NUM INPUT_ABS(ABS_HAT0Y + 1)
+#define INPUT_CHORD_KEY(side_, kmask) { .kind = INPUT_CHORD, .side = side_, .mask = { kmask, kmask } }
+#define INPUT_MODIFIER_KEY(index, kmask) { .kind = INPUT_MODIFIER, .modifier = index, .mask = { kmask, kmask } }
+#define INPUT_FLAG_KEY(kmask) { .kind = INPUT_FLAG, .mask = { kmask, kmask } }
+
+static const struct input_class g_inputs[INPUT_CLASSES_NUM] = {
+    [INPUT_KEY(BTN_SOUTH)] = INPUT_CHORD_KEY(SIDE_RIGHT, KMASK_SOUTH),
+    [INPUT_KEY(BTN_EAST)] = INPUT_CHORD_KEY(SIDE_RIGHT, KMASK_EAST),
+    [INPUT_KEY(BTN_NORTH)] = INPUT_CHORD_KEY(SIDE_RIGHT, KMASK_NORTH),
+    [INPUT_KEY(BTN_WEST)] = INPUT_CHORD_KEY(SIDE_RIGHT, KMASK_WEST),
+    [INPUT_KEY(BTN_TL2)] = INPUT_MODIFIER_KEY(MODIFIER_LT, KMASK_LT), // Control
+    [INPUT_KEY(BTN_TR2)] = INPUT_MODIFIER_KEY(MODIFIER_RT, KMASK_RT), // Shift
+    [INPUT_KEY(BTN_TL)] = INPUT_MODIFIER_KEY(MODIFIER_LB, KMASK_LB), // Super
+    [INPUT_KEY(BTN_TR)] = INPUT_MODIFIER_KEY(MODIFIER_RB, KMASK_RB), // Alt
+    [INPUT_KEY(BTN_SELECT)] = INPUT_FLAG_KEY(KMASK_SHARE),
+    [INPUT_KEY(BTN_START)] = INPUT_FLAG_KEY(KMASK_OPTIONS),
+    [INPUT_KEY(BTN_MODE)] = { .kind = INPUT_MODE },
+    [INPUT_KEY(BTN_THUMBL)] = INPUT_FLAG_KEY(KMASK_THUMBL),
+    [INPUT_KEY(BTN_THUMBR)] = INPUT_FLAG_KEY(KMASK_THUMBR),
+    /* D-pad is a pair of axes, left=-1 right=1 and up=-1 down=1 */
+    [INPUT_ABS(ABS_HAT0X)] = { .kind = INPUT_CHORD, .side = SIDE_LEFT, .mask = { KMASK_LEFT, KMASK_RIGHT } },
+    [INPUT_ABS(ABS_HAT0Y)] = { .kind = INPUT_CHORD, .side = SIDE_LEFT, .mask = { KMASK_UP, KMASK_DOWN } },
+    [INPUT_ABS(ABS_X)] = {
+        .kind = INPUT_STICK,
+        .direction = { STICK_LEFT, STICK_RIGHT },
+        .mask = { KMASK_THUMBL_LEFT, KMASK_THUMBL_RIGHT },
+    },
+    [INPUT_ABS(ABS_Y)] = {
+        .kind = INPUT_STICK,
+        .direction = { STICK_UP, STICK_DOWN },
+        .mask = { KMASK_THUMBL_UP, KMASK_THUMBL_DOWN },
+    },
+    [INPUT_ABS(ABS_RX)] = {
+        .kind = INPUT_STICK,
+        .rstick = true,
+        .direction = { STICK_LEFT, STICK_RIGHT },
+        .mask = { KMASK_THUMBR_LEFT, KMASK_THUMBR_RIGHT },
+    },
+    [INPUT_ABS(ABS_RY)] = {
+        .kind = INPUT_STICK,
+        .rstick = true,
+        .direction = { STICK_UP, STICK_DOWN },
+        .mask = { KMASK_THUMBR_UP, KMASK_THUMBR_DOWN },
+    },
+};
+
+/* Axes whose state is restored with EVIOCGABS after SYN_DROPPED */
+static const uint16_t g_resync_abs[] = {
+    ABS_X, ABS_Y, ABS_RX, ABS_RY, ABS_HAT0X, ABS_HAT0Y,
+};
+
+/*
+ * Verbosity level: 0 disables tracing completely, 1 traces input and output
+ * events, chord commits and mode switches.
+ */
+static int g_verbosity = 1;
+static struct trace_ring g_trace;
+static pthread_t g_trace_drainer;
+static atomic_bool g_trace_stop = false;
+
+/*
+ * Statistics and controller states, published in a shared file mapping with
+ * -T, otherwise kept in the private page, so updates cost the same either way.
+ */
+static struct telemetry g_telemetry_private;
+static struct telemetry *g_telemetry = &g_telemetry_private;
+static const char *g_telemetry_path = NULL;
+/* Time when the frame being processed has been read */
+static uint64_t g_frame_read_ns = 0;
+static volatile sig_atomic_t g_should_dump_stats = false;
+
+static volatile sig_atomic_t g_should_stop = false;
+/*
+ * When set, every controller gets its own virtual keyboard, otherwise all of
+ * them share g_outputs[0].
+ */
+static bool g_separate_outputs = false;
+static struct controller g_controllers[CONTROLLERS_MAX];
+static struct output g_outputs[CONTROLLERS_MAX];
+static size_t g_controllers_num = 0;
+/* Repeats and chord windows share a single timerfd armed for the earliest one */
+static struct repeat g_repeats[REPEATS_MAX];
+/* Time of the record being replayed, zero when running on real devices */
+static uint64_t g_replay_now_ns = 0;
+static int g_timer_fd = -1;
+static uint32_t g_repeat_delay_ms = 500; // Zero turns stick and chord repeats off
+static uint32_t g_repeat_rate = 25; // Per second, at full stick deflection
+static bool g_chord_repeat = false;
+/* Chord keys pressed within the window make a chord, zero commits on release */
+static uint32_t g_chord_window_ms = 0;
+/* Raw input capture file, enabled by the -r option */
+static FILE *g_capture = NULL;
+/* Hotplug monitoring socket, either netlink or a fake one for testing */
+static int g_uevent_fd = -1;
+static bool g_uevent_fake = false;
+static char g_uevent_buf[UEVENT_BUF_SIZE];
+/*
+ * The kernel uevent comes before udev applies the group and ACLs to the node,
+ * so open() fails with EACCES for a user in the input group at first.
+ */
+static struct pending {
+    char path[128];
+    uint64_t next_ns; // CLOCK_MONOTONIC, zero if the slot is free
+    unsigned attempts;
+} g_pending[PENDING_MAX];
+#ifdef USE_IO_URING
+/* The epoll loop is used when fd is -1 */
+static struct uring g_uring = { .fd = -1 };
+#endif
+static uint64_t g_capture_last_us = 0;
+/*
+ * Known stick calibrations, loaded from the -k file. Controllers without one
+ * get g_default_calibration which matches the nominal DS4 stick geometry.
+ */
+static const char *g_calibration_path = NULL;
+static struct calibration g_calibrations[CALIBRATIONS_MAX];
+static size_t g_calibrations_num = 0;
+static const struct calibration g_default_calibration = {
+    .center = { INT8_MAX, INT8_MAX, INT8_MAX, INT8_MAX },
+    .min = { 0, 0, 0, 0 },
+    .max = { 2 * INT8_MAX, 2 * INT8_MAX, 2 * INT8_MAX, 2 * INT8_MAX },
+    .dead_zone = ABT - ABH,
+};
+/* Calibration mode, enabled by the -K option */
+static bool g_calibrate = false;
+
+/*
+ * Another program may hold the grab already, e.g. Steam. That only costs the
+ * controller, which the event loop detaches, not the whole keyboard.
+ */
+static void grab(struct controller *ctl, bool on)
+{
+    if (ioctl(ctl->reader.fd, EVIOCGRAB, (void *)(uintptr_t)on) != 0) {
+        fprintf(stderr, "\"%s\": ioctl(EVIOCGRAB, %d): %s\n", ctl->path, on, strerror(errno));
+        ctl->grab_failed = true;
+    }
+}
+
+static uint64_t clock_ns(clockid_t clockid);
+
+static uint64_t monotonic_ns(void)
+{
+    return clock_ns(CLOCK_MONOTONIC);
+}
+
+static uint64_t timeval_ns(struct timeval time)
+{
+    return (uint64_t)time.tv_sec * UINT64_C(1000000000) + (uint64_t)time.tv_usec * 1000;
+}
+
+/* Never blocks and never formats anything, drops the record if ring is full */
+static void trace(
+        enum trace_kind kind, uint16_t type, uint16_t code, int32_t value, uint32_t keys, uint16_t chord)
+{
+    if (g_verbosity <= 0)
+        return;
+    const size_t head = atomic_load_explicit(&g_trace.head, memory_order_relaxed);
+    const size_t tail = atomic_load_explicit(&g_trace.tail, memory_order_acquire);
+    if (head - tail >= TRACE_RING_SIZE) {
+        atomic_fetch_add_explicit(&g_trace.dropped, 1, memory_order_relaxed);
+        return;
+    }
+    g_trace.records[head & (TRACE_RING_SIZE - 1)] = (struct trace_record){
+        .timestamp_ns = monotonic_ns(),
+        .keys = keys,
+        .value = value,
+        .type = type,
+        .code = code,
+        .chord = chord,
+        .kind = kind,
+    };
+    atomic_store_explicit(&g_trace.head, head + 1, memory_order_release);
+}
+
+static void trace_print(const struct trace_record *r)
+{
+    printf("[%" PRIu64 ".%06" PRIu64 "] ", r->timestamp_ns / UINT64_C(1000000000), r->timestamp_ns / 1000 % 1000000);
+    switch (r->kind) {
+    case TRACE_IN:
+        printf("<- %s, code=%u, value=%d, keys=0x%08" PRIx32 "\n",
+                r->type == EV_KEY ? "EV_KEY" : "EV_ABS", r->code, r->value, r->keys);
+        break;
+    case TRACE_OUT:
+        printf("-> EV_KEY, code=%u, value=%d\n", r->code, r->value);
+        break;
+    case TRACE_SIDE:
+        printf("first = %s\n", r->value == SIDE_LEFT ? "left" : r->value == SIDE_RIGHT ? "right" : "no");
+        break;
+    case TRACE_CHORD:
+        printf("chord keys=0x%08" PRIx32 " -> chords[%u], code=%u\n", r->keys, r->chord, r->code);
+        break;
+    case TRACE_MODE:
+        printf("Keyboard mode %s\n", r->value ? "on" : "off");
+        break;
+    case TRACE_RESYNC:
+        printf("SYN_DROPPED: resynced with %d synthetic events\n", r->value);
+        break;
+    }
+}
+
+/* Returns the number of records printed */
+static size_t trace_drain(void)
+{
+    size_t count = 0;
+    const size_t head = atomic_load_explicit(&g_trace.head, memory_order_acquire);
+    size_t tail = atomic_load_explicit(&g_trace.tail, memory_order_relaxed);
+    for (; tail != head; tail++, count++) {
+        trace_print(&g_trace.records[tail & (TRACE_RING_SIZE - 1)]);
+        atomic_store_explicit(&g_trace.tail, tail + 1, memory_order_release);
+    }
+    const size_t dropped = atomic_exchange_explicit(&g_trace.dropped, 0, memory_order_relaxed);
+    if (dropped) {
+        printf("Trace ring overflow, %zu records dropped\n", dropped);
+    }
+    if (count || dropped) {
+        fflush(stdout);
+    }
+    return count;
+}
+
+static void *trace_drainer(void *_arg)
+{
+    (void) _arg;
+    const struct timespec period = { .tv_sec = 0, .tv_nsec = 10 * 1000 * 1000 };
+    while (!atomic_load_explicit(&g_trace_stop, memory_order_relaxed)) {
+        if (trace_drain() == 0) {
+            nanosleep(&period, NULL);
+        }
+    }
+    return NULL;
+}
+
+static uint64_t clock_ns(clockid_t clockid)
+{
+    struct timespec ts;
+    clock_gettime(clockid, &ts);
+    return (uint64_t)ts.tv_sec * UINT64_C(1000000000) + (uint64_t)ts.tv_nsec;
+}
+
+static void histogram_add(struct histogram *h, uint64_t ns)
+{
+    const size_t bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+    h->buckets[bucket < HISTOGRAM_BUCKETS ? bucket : HISTOGRAM_BUCKETS - 1]++;
+    h->count++;
+    h->sum_ns += ns;
+    if (ns > h->max_ns)
+        h->max_ns = ns;
+}
+
+static void stats_dump(const struct stats *stats)
+{
+    static const char *const stage_names[LATENCY_STAGES_NUM] = {
+        [LATENCY_KERNEL_TO_READ] = "kernel-to-read",
+        [LATENCY_READ_TO_COMMIT] = "read-to-commit",
+        [LATENCY_COMMIT_TO_WRITE] = "commit-to-write",
+    };
+    static const char *const modifier_names[MODIFIERS_NUM] = {
+        [MODIFIER_LT] = "lt",
+        [MODIFIER_RT] = "rt",
+        [MODIFIER_LB] = "lb",
+        [MODIFIER_RB] = "rb",
+    };
+    printf("Latency, ns:\n");
+    for (size_t i = 0; i < LATENCY_STAGES_NUM; i++) {
+        const struct histogram *h = &stats->latency[i];
+        printf("  %-16s count=%" PRIu64 " avg=%" PRIu64 " p50<%" PRIu64 " p90<%" PRIu64
+                " p99<%" PRIu64 " max=%" PRIu64 "\n",
+                stage_names[i],
+                h->count,
+                h->count ? h->sum_ns / h->count : 0,
+                histogram_percentile(h, 50),
+                histogram_percentile(h, 90),
+                histogram_percentile(h, 99),
+                h->max_ns);
+    }
+    printf("Chord hits:\n");
+    for (size_t i = 0; i < CHORD_TABLE_SIZE; i++) {
+        if (stats->chord_hits[i])
+            printf("  %s 0x%02zx code=%u: %" PRIu64 ", entered in %" PRIu64 " ms on average\n",
+                    (i >> 8) == SIDE_LEFT ? "left" : "right",
+                    i & KMASK_CHORD_KEYS,
+                    g_layout->chords[i],
+                    stats->chord_hits[i],
+                    stats->chord_entry_ns[i] / stats->chord_hits[i] / 1000000);
+    }
+    printf("Modifier presses:");
+    for (size_t i = 0; i < MODIFIERS_NUM; i++) {
+        printf(" %s=%" PRIu64, modifier_names[i], stats->modifier_presses[i]);
+    }
+    printf("\nFiltered stick events: %" PRIu64 "\n", stats->stick_filtered);
+    printf("Touchpad samples: %" PRIu64 " in %" PRIu64 " pointer frames\n",
+            stats->touch_samples, stats->touch_frames);
+    if (g_rt_priority > 0) {
+        struct rusage usage;
+        getrusage(RUSAGE_THREAD, &usage);
+        printf("Page faults in realtime mode: minor %ld, major %ld\n",
+                usage.ru_minflt - g_rt_usage.ru_minflt, usage.ru_majflt - g_rt_usage.ru_majflt);
+    }
+#ifdef USE_IO_URING
+    if (g_uring.fd != -1)
+        printf("io_uring_enter calls: %" PRIu64 "\n", g_uring.enters);
+#endif
+#ifdef RTCHECK
+    printf("Allocations and stdio calls while handling input: %" PRIu64 "%s%s\n",
+            g_steady_violations, g_steady_violation ? ", the first one is " : "",
+            g_steady_violation ? g_steady_violation : "");
+#endif
+    fflush(stdout);
+}
+
+static const uint32_t g_modifier_masks[MODIFIERS_NUM] = {
+    [MODIFIER_LT] = KMASK_LT,
+    [MODIFIER_RT] = KMASK_RT,
+    [MODIFIER_LB] = KMASK_LB,
+    [MODIFIER_RB] = KMASK_RB,
+};
+
+_Static_assert(CONTROLLERS_MAX <= TELEMETRY_CONTROLLERS_MAX, "telemetry page has too few controllers");
 
-static void grab(int ifd)
+/* Maps the telemetry page shared with monitors, see telemetry.h */
+static void telemetry_open(const char *path)
 {
-    int ret = ioctl(ifd, EVIOCGRAB, (void *)1);
-    int err = errno;
-    if (ret != 0) {
-        fprintf(stderr, "Grab failed: ioctl(ifd, EVIOCGRAB, 1), err=%d: %s", err, strerror(err));
+    const int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        fprintf(stderr, "\"%s\": ", path);
+        perror("open");
+        exit(1);
+    }
+    /* Truncating first drops whatever a previous instance has left */
+    if (ftruncate(fd, 0) == -1 || ftruncate(fd, sizeof(struct telemetry)) == -1) {
+        fprintf(stderr, "\"%s\": ", path);
+        perror("ftruncate");
+        exit(1);
+    }
+    struct telemetry *page = mmap(NULL, sizeof(*page), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (page == MAP_FAILED) {
+        fprintf(stderr, "\"%s\": ", path);
+        perror("mmap");
         exit(1);
     }
+    /* Faults every page in, the input path shouldn't */
+    memset(page, 0, sizeof(*page));
+    page->version = TELEMETRY_VERSION;
+    page->size = sizeof(*page);
+    page->pid = getpid();
+    page->stuck_ns = TELEMETRY_STUCK_NS;
+    memcpy(page->chords, g_layout->chords, sizeof(page->chords));
+    memcpy(page->magic, TELEMETRY_MAGIC, sizeof(page->magic));
+    g_telemetry = page;
+}
+
+/* Makes the sequence odd, readers retry until telemetry_end() */
+static void telemetry_begin(void)
+{
+    __atomic_store_n(&g_telemetry->sequence, g_telemetry->sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/* Publishes the controller states and makes the sequence even again */
+static void telemetry_end(void)
+{
+    const uint64_t now = monotonic_ns();
+    for (size_t i = 0; i < CONTROLLERS_MAX; i++) {
+        const struct controller *ctl = &g_controllers[i];
+        struct telemetry_controller *tc = &g_telemetry->controllers[i];
+        tc->used = ctl->used;
+        tc->keyboard_mode = ctl->state.keyboard_mode;
+        tc->touchpad = ctl->touchpad;
+        tc->hidraw = ctl->hidraw;
+        tc->keys = ctl->state.keys;
+        for (size_t m = 0; m < MODIFIERS_NUM; m++) {
+            if (!ctl->used || !(ctl->state.keys & g_modifier_masks[m]))
+                tc->modifier_since_ns[m] = 0;
+            else if (tc->modifier_since_ns[m] == 0)
+                tc->modifier_since_ns[m] = now;
+        }
+    }
+    g_telemetry->update_ns = now;
+    __atomic_store_n(&g_telemetry->sequence, g_telemetry->sequence + 1, __ATOMIC_RELEASE);
 }
 
-static void ungrab(int ifd)
+/*
+ * Keeps the event loop in memory and on the CPU: everything mapped so far and
+ * later is locked, the stack is faulted in ahead, and the thread runs with
+ * SCHED_FIFO, optionally pinned. Buffers are static, so they are locked too.
+ */
+static void realtime_setup(void)
 {
-    int ret = ioctl(ifd, EVIOCGRAB, (void *)0);
-    int err = errno;
-    if (ret != 0) {
-        fprintf(stderr, "Ungrab failed: ioctl(ifd, EVIOCGRAB, 0), err=%d: %s", err, strerror(err));
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1) {
+        perror("mlockall");
         exit(1);
     }
+    volatile uint8_t stack[RT_STACK_PREFAULT];
+    for (size_t i = 0; i < sizeof(stack); i += 4096) {
+        stack[i] = 0;
+    }
+    int err;
+    if (g_rt_cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(g_rt_cpu, &set);
+        err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (err != 0) {
+            fprintf(stderr, "pthread_setaffinity_np(%d): %s\n", g_rt_cpu, strerror(err));
+            exit(1);
+        }
+    }
+    const struct sched_param param = { .sched_priority = g_rt_priority };
+    err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (err != 0) {
+        fprintf(stderr, "pthread_setschedparam(SCHED_FIFO, %d): %s\n", g_rt_priority, strerror(err));
+        exit(1);
+    }
+    getrusage(RUSAGE_THREAD, &g_rt_usage);
+}
+
+static void sigusr1_handler(int _value)
+{
+    (void) _value;
+    g_should_dump_stats = true;
 }
 
 static void sigint_handler(int _value)
 {
     (void) _value;
+    // The event loop gets EINTR from epoll_wait(2), then ungrabs and cleans up
     g_should_stop = true;
-    printf("Received SIGINT, quitting...\n");
-    if (g_state.keyboard_mode) {
-        int ret = ioctl(g_ifd, EVIOCGRAB, (void *)0);
-        if (ret != 0) {
-            fprintf(stderr, "Ungrab failed: ");
-            perror("ioctl(g_ifd, EVIOCGRAB, 0)");
-            exit(1);
-        }
-    }
-    // Set default handler and re-issue the signal to unblock the read(3p) call
-    signal(SIGINT, SIG_DFL);
-    kill(0, SIGINT);
 }
 
 static void setup_output_device(int fd)
@@ -228,440 +1063,3188 @@ static void setup_output_device(int fd)
      * created, to pass key events, in this case the space key.
      */
     ioctl(fd, UI_SET_EVBIT, EV_KEY);
-    for (ssize_t i = 0; i < MAPPINGS_NUM; i++) {
-        if (-1 == ioctl(fd, UI_SET_KEYBIT, g_mapping[i].code)) {
+    for (uint32_t code = 0; code < KEY_CNT; code++) {
+        if (!(g_output_keys[code / 8] & (1 << (code % 8))))
+            continue;
+        if (-1 == ioctl(fd, UI_SET_KEYBIT, code)) {
             fprintf(
                     stderr,
                     "ioctl(%d, UI_SET_KEYBIT, %u) = -1, errno=%d: ",
                     fd,
-                    g_mapping[i].code,
+                    code,
                     errno);
             perror("");
         }
     }
+    if (g_touchpad_mode) {
+        /* Pointer driven by the touchpad */
+        ioctl(fd, UI_SET_KEYBIT, BTN_LEFT);
+        ioctl(fd, UI_SET_KEYBIT, BTN_RIGHT);
+        ioctl(fd, UI_SET_EVBIT, EV_REL);
+        ioctl(fd, UI_SET_RELBIT, REL_X);
+        ioctl(fd, UI_SET_RELBIT, REL_Y);
+        ioctl(fd, UI_SET_RELBIT, REL_WHEEL);
+        ioctl(fd, UI_SET_RELBIT, REL_HWHEEL);
+    }
     struct uinput_setup usetup;
     memset(&usetup, 0, sizeof(usetup));
     usetup.id.bustype = BUS_USB;
-    usetup.id.vendor = 0x1234; /* sample vendor */
-    usetup.id.product = 0x5678; /* sample product */
-    strcpy(usetup.name, "Example device");
+    usetup.id.vendor = g_output_vendor;
+    usetup.id.product = g_output_product;
+    usetup.id.version = 1;
+    snprintf(usetup.name, sizeof(usetup.name), "%s", g_output_name);
     ioctl(fd, UI_DEV_SETUP, &usetup);
     ioctl(fd, UI_DEV_CREATE);
 }
 
-static void emit(int fd, int type, int code, int val, struct timeval timestamp)
+#ifdef USE_IO_URING
+/* Maps the rings and registers the reader buffers, false if there is no io_uring */
+static bool uring_setup(void)
 {
-    struct input_event ie = {
-        .type = type,
-        .code = code,
-        .value = val,
-        .time = timestamp,
+    struct io_uring_params params = {
+        .flags = IORING_SETUP_CQSIZE,
+        .cq_entries = URING_COMPLETIONS_MAX,
     };
-    write(fd, &ie, sizeof(ie));
+    const int fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (fd == -1) {
+        perror("io_uring_setup");
+        return false;
+    }
+    if (params.cq_entries > URING_COMPLETIONS_MAX) {
+        fprintf(stderr, "io_uring_setup: %u completion entries, at most %d expected\n",
+                params.cq_entries, URING_COMPLETIONS_MAX);
+        close(fd);
+        return false;
+    }
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    const bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap)
+        sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+    uint8_t *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    uint8_t *cq = single_mmap ? sq :
+        mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    struct io_uring_sqe *sqes = mmap(NULL, params.sq_entries * sizeof(sqes[0]), PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+        perror("mmap(io_uring)");
+        exit(1);
+    }
+    g_uring.fd = fd;
+    g_uring.sq_head = (unsigned *)(sq + params.sq_off.head);
+    g_uring.sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    g_uring.sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    g_uring.sq_entries = params.sq_entries;
+    g_uring.sq_local_tail = *g_uring.sq_tail;
+    g_uring.sqes = sqes;
+    g_uring.cq_head = (unsigned *)(cq + params.cq_off.head);
+    g_uring.cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    g_uring.cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    g_uring.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    /* Submission entries are used in order, so the indirection is identity */
+    unsigned *sq_array = (unsigned *)(sq + params.sq_off.array);
+    for (unsigned i = 0; i < params.sq_entries; i++) {
+        sq_array[i] = i;
+    }
+    struct iovec buffers[CONTROLLERS_MAX];
+    for (size_t i = 0; i < CONTROLLERS_MAX; i++) {
+        buffers[i] = (struct iovec){
+            .iov_base = g_controllers[i].reader.buf,
+            .iov_len = sizeof(g_controllers[i].reader.buf),
+        };
+    }
+    /* Pinning may exceed RLIMIT_MEMLOCK, plain reads work just as well */
+    g_uring.fixed = syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, buffers, CONTROLLERS_MAX) == 0;
+    return true;
 }
 
-static void emulate_key_press(int ofd, int code, struct timeval timestamp)
+/* Submits everything queued and waits for min_complete completions */
+static int uring_enter(unsigned min_complete)
 {
-    emit(ofd, EV_KEY, code, 1, timestamp);
-    emit(ofd, EV_SYN, SYN_REPORT, 0, timestamp);
-    printf("-> EV_KEY, code=%u, value=%d\n", code, 1);
+    __atomic_store_n(g_uring.sq_tail, g_uring.sq_local_tail, __ATOMIC_RELEASE);
+    const unsigned to_submit = g_uring.sq_local_tail - __atomic_load_n(g_uring.sq_head, __ATOMIC_ACQUIRE);
+    g_uring.enters++;
+    return syscall(__NR_io_uring_enter, g_uring.fd, to_submit, min_complete,
+            min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
 }
 
-static void emulate_key_release(int ofd, int code, struct timeval timestamp)
+static struct io_uring_sqe *uring_sqe(uint8_t opcode, int fd, uint64_t data)
 {
-    emit(ofd, EV_KEY, code, 0, timestamp);
-    emit(ofd, EV_SYN, SYN_REPORT, 0, timestamp);
-    printf("-> EV_KEY, code=%u, value=%d\n", code, 0);
+    /* Never happens with the few requests in flight, but just in case */
+    if (g_uring.sq_local_tail - __atomic_load_n(g_uring.sq_head, __ATOMIC_ACQUIRE) >= g_uring.sq_entries &&
+            uring_enter(0) == -1) {
+        perror("io_uring_enter");
+        exit(1);
+    }
+    struct io_uring_sqe *sqe = &g_uring.sqes[g_uring.sq_local_tail++ & g_uring.sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = data;
+    return sqe;
 }
 
-static void emulate_key(int ofd, int code, struct timeval timestamp)
+/* Posts a read of fd, preceded by a linked poll on kernels that need it */
+static struct io_uring_sqe *uring_read(uint8_t opcode, int fd, void *buf, size_t len, uint64_t data)
 {
-    emulate_key_press(ofd, code, timestamp);
-    emulate_key_release(ofd, code, timestamp);
+    if (g_uring.poll_first) {
+        struct io_uring_sqe *poll = uring_sqe(IORING_OP_POLL_ADD, fd, URING_DATA(URING_IGNORE, 0, 0));
+        poll->poll32_events = EPOLLIN;
+        poll->flags = IOSQE_IO_LINK;
+    }
+    struct io_uring_sqe *sqe = uring_sqe(opcode, fd, data);
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = len;
+    return sqe;
 }
 
-static enum side which_side_key(struct input_event ev)
+/* Reads the next batch of events, or the next report, into the reader buffer */
+static void uring_read_post(struct controller *ctl)
 {
-    if (ev.type == EV_KEY) {
-        switch (ev.code) {
-        case BTN_SOUTH:
-        case BTN_EAST:
-        case BTN_WEST:
-        case BTN_NORTH:
-            return SIDE_RIGHT;
-        };
-    } else if (ev.type == EV_ABS) {
-        /*
-         * d-pad is EV_ABS
-         * left-right: code ABS_HAT0X, left=-1, right=1
-         * down-up: code ABS_HAT0Y, up=-1, down=1
-         */
-        if (ev.code == ABS_HAT0X || ev.code == ABS_HAT0Y)
-            return SIDE_LEFT;
+    const size_t index = ctl - g_controllers;
+    struct io_uring_sqe *sqe = uring_read(g_uring.fixed ? IORING_OP_READ_FIXED : IORING_OP_READ,
+            ctl->reader.fd, ctl->reader.buf, ctl->hidraw ? HIDRAW_REPORT_MAX : sizeof(ctl->reader.buf),
+            URING_DATA(URING_READ, g_uring.generation[index], index));
+    sqe->buf_index = index;
+    g_uring.read_posted[index] = true;
+}
+
+/* Cancels the read of the detached controller and ignores whatever it returns */
+static void uring_read_cancel(struct controller *ctl)
+{
+    const size_t index = ctl - g_controllers;
+    if (g_uring.read_posted[index]) {
+        struct io_uring_sqe *sqe = uring_sqe(IORING_OP_ASYNC_CANCEL, -1, URING_DATA(URING_IGNORE, 0, 0));
+        sqe->addr = URING_DATA(URING_READ, g_uring.generation[index], index);
     }
-    return SIDE_NO;
+    g_uring.read_posted[index] = false;
+    g_uring.generation[index]++;
 }
 
-static enum side which_side_state(struct state state)
+/* Hands the filled buffer to the ring, unless the previous write is in flight */
+static void uring_write_submit(struct output *out)
 {
-    return (state.keys >> KMASK_SIDE_SHIFT) & 3;
+    const int staging = out->ring_staging;
+    if (out->ring_in_flight || out->ring_len[staging] == 0)
+        return;
+    struct io_uring_sqe *sqe = uring_sqe(IORING_OP_WRITE, out->fd, URING_DATA(URING_WRITE, 0, out - g_outputs));
+    sqe->addr = (uintptr_t)out->ring_buf[staging];
+    sqe->len = out->ring_len[staging] * sizeof(out->ring_buf[0][0]);
+    out->ring_in_flight = true;
+    out->ring_staging = !staging;
+    out->ring_commit_ns = out->commit_ns;
+    out->commit_ns = 0;
 }
 
-static struct state release_all(int ofd, struct state state, struct timeval timestamp)
+static void uring_write_done(struct output *out, int32_t res)
 {
-    if (state.keys & KMASK_LT) {
-        emulate_key_release(ofd, KEY_LEFTCTRL, timestamp);
+    const int written = !out->ring_staging;
+    const size_t size = out->ring_len[written] * sizeof(out->ring_buf[0][0]);
+    if (res < 0)
+        fprintf(stderr, "write(%d, %zu events): %s\n", out->fd, out->ring_len[written], strerror(-res));
+    else if ((size_t)res != size)
+        fprintf(stderr, "write(%d): %d bytes of %zu written\n", out->fd, res, size);
+    out->ring_len[written] = 0;
+    out->ring_in_flight = false;
+    if (out->ring_commit_ns) {
+        histogram_add(&g_telemetry->stats.latency[LATENCY_COMMIT_TO_WRITE], monotonic_ns() - out->ring_commit_ns);
+        out->ring_commit_ns = 0;
     }
-    if (state.keys & KMASK_RT) {
-        emulate_key_release(ofd, KEY_LEFTSHIFT, timestamp);
-    }
-    if (state.keys & KMASK_LB) {
-        emulate_key_release(ofd, KEY_LEFTMETA, timestamp);
-    }
-    if (state.keys & KMASK_RB) {
-        emulate_key_release(ofd, KEY_LEFTALT, timestamp);
-    }
-    if (state.keys & KMASK_THUMBL_LEFT)
-        emulate_key_release(ofd, KEY_LEFT, timestamp);
-    else if (state.keys & KMASK_THUMBL_RIGHT)
-        emulate_key_release(ofd, KEY_RIGHT, timestamp);
-    if (state.keys & KMASK_THUMBL_UP)
-        emulate_key_release(ofd, KEY_UP, timestamp);
-    else if (state.keys & KMASK_THUMBL_DOWN)
-        emulate_key_release(ofd, KEY_DOWN, timestamp);
-    state.keys = 0;
-    return state;
 }
 
-static struct state keypress(struct state state, struct input_event ev, int ofd)
+/*
+ * Takes all completions off the ring. Writes are finished right away, the
+ * rest is left in g_uring.completions for the loop. That holds as many as the
+ * CQ ring, and reads are posted once per loop iteration, so it can't fill up.
+ * If it ever did, the rest would stay on the ring for the next reap.
+ */
+static void uring_reap(void)
 {
-    if (state.keyboard_mode == false) {
-        if (ev.type == EV_KEY && ev.code == BTN_MODE) {
-            state.keyboard_mode = true;
-            grab(g_ifd);
-            printf("Keyboard mode on\n");
+    unsigned head = *g_uring.cq_head;
+    const unsigned tail = __atomic_load_n(g_uring.cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        const struct io_uring_cqe cqe = g_uring.cqes[head & g_uring.cq_mask];
+        const unsigned kind = URING_KIND(cqe.user_data);
+        if (kind == URING_WRITE) {
+            uring_write_done(&g_outputs[URING_INDEX(cqe.user_data)], cqe.res);
+        } else if (kind != URING_IGNORE) {
+            if (g_uring.completions_num == URING_COMPLETIONS_MAX)
+                break;
+            g_uring.completions[g_uring.completions_num++] = cqe;
         }
-        return state;
     }
-    printf("<- %s, code=%u, value=%d\n", ev.type == EV_KEY ? "EV_KEY" : "EV_ABS", ev.code, ev.value);
-    if (which_side_state(state) == SIDE_NO) {
-        const enum side side = which_side_key(ev);
-        printf("first = %s\n", side == SIDE_LEFT ? "left" : side == SIDE_RIGHT ? "right" : "no");
-        state.keys |= ((uint32_t)side & 3) << KMASK_SIDE_SHIFT;
-    }
-    if (ev.type == EV_KEY) {
-        switch (ev.code) {
-        case BTN_SOUTH:
-            state.keys |= KMASK_SOUTH;
-            state.keys |= KMASK_PRESSED;
-            break;
-        case BTN_EAST:
-            state.keys |= KMASK_EAST;
-            state.keys |= KMASK_PRESSED;
-            break;
-        case BTN_WEST:
-            state.keys |= KMASK_WEST;
-            state.keys |= KMASK_PRESSED;
-            break;
-        case BTN_NORTH:
-            state.keys |= KMASK_NORTH;
-            state.keys |= KMASK_PRESSED;
-            break;
-        case BTN_TL2:
-            // Control
-            if (state.keyboard_mode) {
-                state.keys |= KMASK_LT;
-                emulate_key_press(ofd, KEY_LEFTCTRL, ev.time);
-            }
-            break;
-        case BTN_TR2:
-            // Shift
-            if (state.keyboard_mode) {
-                state.keys |= KMASK_RT;
-                emulate_key_press(ofd, KEY_LEFTSHIFT, ev.time);
-            }
-            break;
-        case BTN_TL:
-            // Super
-            if (state.keyboard_mode) {
-                state.keys |= KMASK_LB;
-                emulate_key_press(ofd, KEY_LEFTMETA, ev.time);
-            }
-            break;
-        case BTN_TR:
-            // Alt
-            if (state.keyboard_mode) {
-                state.keys |= KMASK_RB;
-                emulate_key_press(ofd, KEY_LEFTALT, ev.time);
-            }
-            break;
-        case BTN_SELECT:
-            state.keys |= KMASK_SHARE;
-            break;
-        case BTN_START:
-            state.keys |= KMASK_OPTIONS;
-            break;
-        case BTN_MODE:
-            state.keyboard_mode = false;
-            state = release_all(ofd, state, ev.time);
-            ungrab(g_ifd);
-            printf("Keyboard mode off\n");
-            break;
-        };
-    } else if (state.keyboard_mode && ev.type == EV_ABS) {
-        /*
-         * d-pad is EV_ABS
-         * left-right: code ABS_HAT0X, left=-1, right=1
-         * down-up: code ABS_HAT0Y, up=-1, down=1
-         */
-        if (ev.code == ABS_HAT0X) {
-            if (ev.value == -1) {
-                state.keys |= KMASK_LEFT;
-                state.keys |= KMASK_PRESSED;
-            } else if (ev.value == 1) {
-                state.keys |= KMASK_RIGHT;
-                state.keys |= KMASK_PRESSED;
-            }
-        } else if (ev.code == ABS_HAT0Y) {
-            if (ev.value == -1) {
-                state.keys |= KMASK_UP;
-                state.keys |= KMASK_PRESSED;
-            } else if (ev.value == 1) {
-                state.keys |= KMASK_DOWN;
-                state.keys |= KMASK_PRESSED;
-            }
-        } else if (ev.code == ABS_X) {
-            if (ev.value == -1) {
-                emulate_key_press(ofd, KEY_LEFT, ev.time);
-                state.keys |= KMASK_THUMBL_LEFT;
-            } else if (ev.value == 1) {
-                emulate_key_press(ofd, KEY_RIGHT, ev.time);
-                state.keys |= KMASK_THUMBL_RIGHT;
-            }
-        } else if (ev.code == ABS_Y) {
-            if (ev.value == -1) {
-                emulate_key_press(ofd, KEY_UP, ev.time);
-                state.keys |= KMASK_THUMBL_UP;
-            } else if (ev.value == 1) {
-                    emulate_key_press(ofd, KEY_DOWN, ev.time);
-                    state.keys |= KMASK_THUMBL_DOWN;
-            }
-        } else if (ev.code == ABS_RX) {
-            if (ev.value == -1) {
-                state.keys |= KMASK_THUMBR_LEFT;
-            } else if (ev.value == 1) {
-                state.keys |= KMASK_THUMBR_RIGHT;
-            }
-        } else if (ev.code == ABS_RY) {
-            if (ev.value == -1) {
-                state.keys |= KMASK_THUMBR_UP;
-            } else if (ev.value == 1) {
-                state.keys |= KMASK_THUMBR_DOWN;
-            }
-        }
+    __atomic_store_n(g_uring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+static void uring_wait(void)
+{
+    if (uring_enter(1) == -1 && errno != EINTR) {
+        perror("io_uring_enter");
+        exit(1);
     }
-    return state;
+    uring_reap();
 }
 
-static struct state keyrelease(struct state state, struct input_event ev, int ofd)
+/*
+ * Queues the pending events followed by the extra ones for the next
+ * submission. Waits for the write in flight if they don't fit, and returns
+ * false if they wouldn't fit even into an empty buffer.
+ */
+static bool uring_write_stage(struct output *out, const struct input_event *extra, size_t extra_len)
 {
-    if (state.keyboard_mode == false) {
-        return state;
+    const size_t len = out->len + extra_len;
+    while (out->ring_len[out->ring_staging] + len > URING_WRITE_MAX &&
+            (out->ring_in_flight || out->ring_len[out->ring_staging] > 0)) {
+        uring_write_submit(out);
+        uring_wait();
     }
-    printf("<- %s, code=%u, value=%d\n", ev.type == EV_KEY ? "EV_KEY" : "EV_ABS", ev.code, ev.value);
-    if (state.keys & KMASK_PRESSED) {
-        for (ssize_t i = 0; i < MAPPINGS_NUM; i++) {
-            struct mapping mapping = g_mapping[i];
-            if (mapping.code && mapping.first == which_side_state(state) &&
-                    (state.keys & KMASK_CHORD_KEYS) == mapping.keys) {
-                emulate_key(ofd, mapping.code, ev.time);
-            }
+    if (len > URING_WRITE_MAX)
+        return false;
+    struct input_event *buf = out->ring_buf[out->ring_staging];
+    size_t *buf_len = &out->ring_len[out->ring_staging];
+    memcpy(buf + *buf_len, out->buf, out->len * sizeof(out->buf[0]));
+    *buf_len += out->len;
+    if (extra_len)
+        memcpy(buf + *buf_len, extra, extra_len * sizeof(extra[0]));
+    *buf_len += extra_len;
+    out->len = 0;
+    return true;
+}
+
+/* Waits until everything queued for the output has been written */
+static void uring_write_drain(struct output *out)
+{
+    while (out->ring_in_flight || out->ring_len[out->ring_staging] > 0) {
+        uring_write_submit(out);
+        uring_wait();
+    }
+}
+#endif
+
+/*
+ * Writes the pending events followed by the extra ones with a single writev,
+ * so a whole macro goes out in one syscall along with the current frame.
+ */
+static void output_write(struct output *out, const struct input_event *extra, size_t extra_len)
+{
+    if (out->sink) {
+        if (out->sink_len + out->len + extra_len > out->sink_cap) {
+            out->sink_cap = (out->sink_len + out->len + extra_len) * 2;
+            out->sink = realloc(out->sink, out->sink_cap * sizeof(out->sink[0]));
+            if (out->sink == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        memcpy(out->sink + out->sink_len, out->buf, out->len * sizeof(out->buf[0]));
+        out->sink_len += out->len;
+        if (extra_len)
+            memcpy(out->sink + out->sink_len, extra, extra_len * sizeof(extra[0]));
+        out->sink_len += extra_len;
+        out->len = 0;
+        out->commit_ns = 0;
+        return;
+    }
+#ifdef USE_IO_URING
+    if (g_uring.fd != -1 && uring_write_stage(out, extra, extra_len))
+        return;
+#endif
+    struct iovec iov[2] = {
+        { .iov_base = out->buf, .iov_len = out->len * sizeof(out->buf[0]) },
+        { .iov_base = (void *)extra, .iov_len = extra_len * sizeof(extra[0]) },
+    };
+    struct iovec *vec = iov;
+    int vec_num = 2;
+    while (vec_num > 0) {
+        if (vec->iov_len == 0) {
+            vec++;
+            vec_num--;
+            continue;
+        }
+        ssize_t ret = writev(out->fd, vec, vec_num);
+        if (ret == -1) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "writev(%d, %zu events): ", out->fd, out->len + extra_len);
+            perror("");
+            break;
+        }
+        /* Short writes are not expected from uinput, but just in case */
+        while (ret > 0) {
+            const size_t done = (size_t)ret < vec->iov_len ? (size_t)ret : vec->iov_len;
+            vec->iov_base = (char *)vec->iov_base + done;
+            vec->iov_len -= done;
+            ret -= done;
+            if (vec->iov_len == 0) {
+                vec++;
+                vec_num--;
+            }
+        }
+    }
+    out->len = 0;
+    if (out->commit_ns) {
+        histogram_add(&g_telemetry->stats.latency[LATENCY_COMMIT_TO_WRITE], monotonic_ns() - out->commit_ns);
+        out->commit_ns = 0;
+    }
+}
+
+static void output_flush(struct output *out)
+{
+    output_write(out, NULL, 0);
+}
+
+/* Makes sure everything emitted so far has reached the device */
+static void output_drain(struct output *out)
+{
+    output_flush(out);
+#ifdef USE_IO_URING
+    if (g_uring.fd != -1)
+        uring_write_drain(out);
+#endif
+}
+
+/*
+ * Appends an event to the output batch. The batch is written to uinput with a
+ * single write(2) call by output_flush().
+ */
+static void emit(struct output *out, int type, int code, int val, struct timeval timestamp)
+{
+    if (out->len >= OUTPUT_MAX) {
+        output_flush(out);
+    }
+    out->buf[out->len++] = (struct input_event){
+        .type = type,
+        .code = code,
+        .value = val,
+        .time = timestamp,
+    };
+    out->unsynced = true;
+}
+
+/*
+ * Terminates the current output frame. Empty frames are never emitted, so
+ * several key changes may share a single SYN_REPORT.
+ */
+static void emit_syn(struct output *out, struct timeval timestamp)
+{
+    if (!out->unsynced)
+        return;
+    emit(out, EV_SYN, SYN_REPORT, 0, timestamp);
+    out->unsynced = false;
+}
+
+static void emulate_key_press(struct output *out, int code, struct timeval timestamp)
+{
+    emit(out, EV_KEY, code, 1, timestamp);
+    emit_syn(out, timestamp);
+    trace(TRACE_OUT, EV_KEY, code, 1, 0, 0);
+}
+
+static void emit_key_release(struct output *out, int code, struct timeval timestamp)
+{
+    emit(out, EV_KEY, code, 0, timestamp);
+    trace(TRACE_OUT, EV_KEY, code, 0, 0, 0);
+}
+
+static void emulate_key_release(struct output *out, int code, struct timeval timestamp)
+{
+    emit_key_release(out, code, timestamp);
+    emit_syn(out, timestamp);
+}
+
+/* Modifier keys held on the output by the triggers and bumpers of any pad */
+static size_t modifiers_held(const struct output *out, uint16_t codes[MODIFIERS_NUM])
+{
+    size_t count = 0;
+    for (size_t m = 0; m < MODIFIERS_NUM; m++) {
+        bool held = false;
+        for (size_t i = 0; i < CONTROLLERS_MAX && !held; i++) {
+            const struct controller *ctl = &g_controllers[i];
+            held = ctl->used && ctl->out == out && (ctl->state.keys & g_modifier_masks[m]);
+        }
+        const uint16_t code = g_layout->modifiers[m];
+        for (size_t j = 0; held && j < count; j++) {
+            held = codes[j] != code;
+        }
+        if (held)
+            codes[count++] = code;
+    }
+    return count;
+}
+
+/*
+ * Keeps track of the word being typed, any key other than a letter ends it, and
+ * so does a letter typed with a modifier other than Shift, e.g. Ctrl+W.
+ */
+static void word_track(struct output *out, int code)
+{
+    struct word_state *word = &out->word;
+    if (g_dict == NULL)
+        return;
+    word->candidate = 0;
+    if (code == KEY_BACKSPACE) {
+        if (word->overflow > 0)
+            word->overflow--;
+        else if (word->len > 0)
+            word->len--;
+        return;
+    }
+    uint16_t held[MODIFIERS_NUM];
+    const size_t held_num = modifiers_held(out, held);
+    for (size_t i = 0; i < held_num; i++) {
+        if (held[i] != KEY_LEFTSHIFT && held[i] != KEY_RIGHTSHIFT)
+            code = 0;
+    }
+    for (size_t i = 0; i < sizeof(g_letter_keys) / sizeof(g_letter_keys[0]); i++) {
+        if (g_letter_keys[i] == code) {
+            /* Longer words are never in the dictionary, stop completing */
+            if (word->len < DICT_WORD_MAX && word->overflow == 0)
+                word->text[word->len++] = 'a' + i;
+            else
+                word->overflow++;
+            return;
+        }
+    }
+    word->len = 0;
+    word->overflow = 0;
+}
+
+static void emulate_key(struct output *out, int code, struct timeval timestamp)
+{
+    emulate_key_press(out, code, timestamp);
+    emulate_key_release(out, code, timestamp);
+    word_track(out, code);
+}
+
+/* Returns the trie node of the prefix, DICT_NONE if no word starts with it */
+static uint32_t dict_lookup(const char *prefix, uint32_t len)
+{
+    uint32_t node = 0;
+    for (uint32_t pos = 0; pos < len;) {
+        const struct dict_node *n = &g_dict_nodes[node];
+        uint32_t lo = n->edges_first, hi = n->edges_first + n->edges_num;
+        while (lo < hi) {
+            const uint32_t mid = lo + (hi - lo) / 2;
+            if (g_dict_text[g_dict_edges[mid].label] < prefix[pos])
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if (lo == n->edges_first + n->edges_num || g_dict_text[g_dict_edges[lo].label] != prefix[pos])
+            return DICT_NONE;
+        const struct dict_edge *edge = &g_dict_edges[lo];
+        /* The prefix may end in the middle of the label */
+        const uint32_t common = edge->label_len < len - pos ? edge->label_len : len - pos;
+        if (memcmp(g_dict_text + edge->label, prefix + pos, common) != 0)
+            return DICT_NONE;
+        pos += common;
+        node = edge->node;
+    }
+    return node;
+}
+
+/* Types the letters of the word after the first skip of them */
+static void word_type(struct output *out, const struct dict_word *word, uint32_t skip, struct timeval timestamp)
+{
+    for (uint32_t i = skip; i < word->len; i++) {
+        const uint16_t code = g_letter_keys[g_dict_text[word->text + i] - 'a'];
+        emulate_key_press(out, code, timestamp);
+        emulate_key_release(out, code, timestamp);
+    }
+}
+
+/*
+ * Offers the next completion of the letters typed by hand, replacing the
+ * previously offered one. After the last completion the bare prefix is left,
+ * and the cycle starts over.
+ */
+static void word_complete(struct output *out, struct timeval timestamp)
+{
+    struct word_state *word = &out->word;
+    if (g_dict == NULL || word->len == 0 || word->overflow > 0)
+        return;
+    if (word->candidate == 0) {
+        word->prefix_len = word->len;
+    } else {
+        for (uint32_t i = word->prefix_len; i < word->len; i++) {
+            emulate_key_press(out, KEY_BACKSPACE, timestamp);
+            emulate_key_release(out, KEY_BACKSPACE, timestamp);
+        }
+        word->len = word->prefix_len;
+    }
+    const uint32_t node = dict_lookup(word->text, word->prefix_len);
+    for (uint32_t k = word->candidate; node != DICT_NONE && k < DICT_CANDIDATES; k++) {
+        const uint32_t index = g_dict_nodes[node].top[k];
+        if (index == DICT_NONE)
+            break;
+        const struct dict_word *candidate = &g_dict_words[index];
+        if (candidate->len <= word->prefix_len)
+            continue;
+        word_type(out, candidate, word->prefix_len, timestamp);
+        memcpy(word->text, g_dict_text + candidate->text, candidate->len);
+        word->len = candidate->len;
+        word->candidate = k + 1;
+        return;
+    }
+    word->candidate = 0;
+}
+
+/*
+ * Accepts the offered completion, or the best one if none is offered, and
+ * ends the word with a space. It all goes out in a single burst.
+ */
+static void word_accept(struct output *out, struct timeval timestamp)
+{
+    struct word_state *word = &out->word;
+    if (g_dict == NULL)
+        return;
+    if (word->candidate == 0)
+        word_complete(out, timestamp);
+    emulate_key(out, KEY_SPACE, timestamp);
+}
+
+static void keymap_free(struct keymap *keymap)
+{
+    free(keymap);
+}
+
+static void keymap_use(struct keymap *keymap)
+{
+    g_keymap = keymap;
+    g_layout = &keymap->layout;
+    g_macro_events = keymap->macro_events;
+}
+
+/*
+ * Counts the triggers and bumpers that hold the key on the output, over every
+ * pad writing to it. A pad releases a shared modifier only as the last holder.
+ */
+static size_t modifier_holders(const struct output *out, uint16_t code)
+{
+    size_t count = 0;
+    for (size_t i = 0; i < CONTROLLERS_MAX; i++) {
+        const struct controller *ctl = &g_controllers[i];
+        if (!ctl->used || ctl->out != out)
+            continue;
+        for (size_t m = 0; m < MODIFIERS_NUM; m++) {
+            if ((ctl->state.keys & g_modifier_masks[m]) && g_layout->modifiers[m] == code)
+                count++;
+        }
+    }
+    return count;
+}
+
+static void modifiers_press(struct output *out, const uint16_t *codes, size_t count, struct timeval timestamp)
+{
+    for (size_t i = 0; i < count; i++) {
+        emit(out, EV_KEY, codes[i], 1, timestamp);
+    }
+    emit_syn(out, timestamp);
+}
+
+/*
+ * Sends the macro right after the current frame. Timestamps are left zero,
+ * uinput stamps events itself. Held modifiers are lifted for the macro and
+ * pressed again after it, so it types the same text under Ctrl and its own
+ * Shift steps don't drop them.
+ */
+static void macro_emit(struct output *out, uint32_t index, struct timeval timestamp)
+{
+    if (index >= g_layout->macros_num)
+        return;
+    const struct input_event *events = &g_macro_events[g_layout->macro_first[index]];
+    const size_t count = g_layout->macro_first[index + 1] - g_layout->macro_first[index];
+    trace(TRACE_OUT, EV_KEY, LAYOUT_ACTION_MACRO + index, count, 0, 0);
+    word_track(out, 0);
+    uint16_t held[MODIFIERS_NUM];
+    const size_t held_num = modifiers_held(out, held);
+    for (size_t i = 0; i < held_num; i++) {
+        emit_key_release(out, held[i], timestamp);
+    }
+    emit_syn(out, timestamp);
+    if (g_macro_pace_us == 0) {
+        output_write(out, events, count);
+        modifiers_press(out, held, held_num, timestamp);
+        return;
+    }
+    /* Paced macros block the loop, which is fine for something that slow */
+    output_drain(out);
+    size_t frame = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (events[i].type != EV_SYN)
+            continue;
+        output_write(out, &events[frame], i + 1 - frame);
+        output_drain(out);
+        frame = i + 1;
+        const struct timespec pause = {
+            .tv_sec = g_macro_pace_us / 1000000,
+            .tv_nsec = g_macro_pace_us % 1000000 * 1000,
+        };
+        nanosleep(&pause, NULL);
+    }
+    modifiers_press(out, held, held_num, timestamp);
+}
+
+/* Chord codes are keys, except for the macros and the word mode actions */
+static void chord_commit(struct output *out, uint16_t code, struct timeval timestamp)
+{
+    if (code >= LAYOUT_ACTION_MACRO && code < LAYOUT_ACTION_MACRO + LAYOUT_MACROS_MAX)
+        macro_emit(out, code - LAYOUT_ACTION_MACRO, timestamp);
+    else if (code == LAYOUT_ACTION_COMPLETE)
+        word_complete(out, timestamp);
+    else if (code == LAYOUT_ACTION_ACCEPT)
+        word_accept(out, timestamp);
+    else
+        emulate_key(out, code, timestamp);
+}
+
+static const struct dict_header *dict_load(const char *path)
+{
+    const int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        fprintf(stderr, "\"%s\": ", path);
+        perror("open");
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(struct dict_header)) {
+        fprintf(stderr, "\"%s\": not a dictionary image\n", path);
+        close(fd);
+        return NULL;
+    }
+    const size_t size = st.st_size;
+    const struct dict_header *dict = mmap(NULL, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (dict == MAP_FAILED) {
+        fprintf(stderr, "\"%s\": ", path);
+        perror("mmap");
+        return NULL;
+    }
+    const struct dict_node *nodes = (const void *)(dict + 1);
+    const struct dict_edge *edges = (const void *)(nodes + dict->nodes_num);
+    const struct dict_word *words = (const void *)(edges + dict->edges_num);
+    const char *text = (const void *)(words + dict->words_num);
+    bool valid = memcmp(dict->magic, DICT_MAGIC, sizeof(dict->magic)) == 0 &&
+        dict->version == DICT_VERSION && dict->nodes_num > 0 &&
+        sizeof(*dict) + (uint64_t)dict->nodes_num * sizeof(*nodes) +
+        (uint64_t)dict->edges_num * sizeof(*edges) + (uint64_t)dict->words_num * sizeof(*words) +
+        dict->text_size == size;
+    /* Lookups don't check bounds, so everything is checked once here */
+    for (uint32_t i = 0; valid && i < dict->nodes_num; i++) {
+        valid = nodes[i].edges_first <= dict->edges_num &&
+            nodes[i].edges_num <= dict->edges_num - nodes[i].edges_first;
+        for (size_t k = 0; valid && k < DICT_CANDIDATES; k++) {
+            valid = nodes[i].top[k] == DICT_NONE || nodes[i].top[k] < dict->words_num;
+        }
+    }
+    for (uint32_t i = 0; valid && i < dict->edges_num; i++) {
+        valid = edges[i].node < dict->nodes_num && edges[i].label_len > 0 &&
+            edges[i].label < dict->text_size && edges[i].label_len <= dict->text_size - edges[i].label;
+    }
+    for (uint32_t i = 0; valid && i < dict->words_num; i++) {
+        valid = words[i].len <= DICT_WORD_MAX && words[i].text <= dict->text_size &&
+            words[i].len <= dict->text_size - words[i].text;
+        for (uint32_t j = 0; valid && j < words[i].len; j++) {
+            valid = text[words[i].text + j] >= 'a' && text[words[i].text + j] <= 'z';
+        }
+    }
+    if (!valid) {
+        fprintf(stderr, "\"%s\": not a dictionary image or unsupported version\n", path);
+        munmap((void *)dict, size);
+        return NULL;
+    }
+    g_dict_nodes = nodes;
+    g_dict_edges = edges;
+    g_dict_words = words;
+    g_dict_text = text;
+    return dict;
+}
+
+static const struct input_class *input_classify(struct input_event ev)
+{
+    static const struct input_class none = { .kind = INPUT_NONE };
+    if (ev.type == EV_KEY && ev.code >= BTN_SOUTH && ev.code <= BTN_THUMBR)
+        return &g_inputs[INPUT_KEY(ev.code)];
+    if (ev.type == EV_ABS && ev.code <= ABS_HAT0Y)
+        return &g_inputs[INPUT_ABS(ev.code)];
+    return &none;
+}
+
+/* The key a tilt of the stick taps, zero if there is none */
+static uint16_t input_stick_key(const struct input_class *input, bool positive)
+{
+    const uint16_t *keys = input->rstick ? g_layout->rstick : g_layout->stick;
+    return keys[input->direction[positive]];
+}
+
+static enum side which_side_state(struct state state)
+{
+    return (state.keys >> KMASK_SIDE_SHIFT) & 3;
+}
+
+/*
+ * Fills g_builtin_layout from g_mapping and reports duplicate and unreachable
+ * chords. Returns the number of problems found.
+ */
+static int build_builtin_layout(void)
+{
+    struct layout *layout = &g_builtin_layout;
+    /* g_mapping index plus one for every chord, to report duplicates */
+    uint16_t sources[CHORD_TABLE_SIZE] = {0};
+    int problems = 0;
+    memset(layout, 0, sizeof(*layout));
+    memcpy(layout->magic, LAYOUT_MAGIC, sizeof(layout->magic));
+    layout->version = LAYOUT_VERSION;
+    layout->size = sizeof(*layout);
+    layout->modifiers[MODIFIER_LT] = KEY_LEFTCTRL;
+    layout->modifiers[MODIFIER_RT] = KEY_LEFTSHIFT;
+    layout->modifiers[MODIFIER_LB] = KEY_LEFTMETA;
+    layout->modifiers[MODIFIER_RB] = KEY_LEFTALT;
+    layout->stick[STICK_LEFT] = KEY_LEFT;
+    layout->stick[STICK_RIGHT] = KEY_RIGHT;
+    layout->stick[STICK_UP] = KEY_UP;
+    layout->stick[STICK_DOWN] = KEY_DOWN;
+    layout->rstick[STICK_LEFT] = KEY_HOME;
+    layout->rstick[STICK_RIGHT] = KEY_END;
+    layout->rstick[STICK_UP] = KEY_PAGEUP;
+    layout->rstick[STICK_DOWN] = KEY_PAGEDOWN;
+    for (size_t i = 0; i < STICK_DIRECTIONS_NUM; i++) {
+        layout_add_key(layout, layout->rstick[i]);
+    }
+    for (size_t i = 0; i < MAPPINGS_NUM; i++) {
+        const struct mapping mapping = g_mapping[i];
+        if (mapping.code)
+            layout_add_key(layout, mapping.code);
+        if (mapping.first == SIDE_NO)
+            continue;
+        if (!chord_reachable(mapping.first, mapping.keys)) {
+            fprintf(stderr, "g_mapping[%zu]: chord is unreachable, code=%u\n", i, mapping.code);
+            problems++;
+            continue;
+        }
+        const size_t index = chord_index(mapping.first, mapping.keys);
+        if (sources[index]) {
+            fprintf(
+                    stderr,
+                    "g_mapping[%zu]: chord duplicates g_mapping[%u], code=%u ignored\n",
+                    i,
+                    sources[index] - 1,
+                    mapping.code);
+            problems++;
+            continue;
+        }
+        sources[index] = i + 1;
+        layout->chords[index] = mapping.code;
+    }
+    return problems;
+}
+
+/*
+ * Reads the compiled layout image produced by layoutc into a new keymap and
+ * expands its macros. The image is used as is, so only the header is
+ * validated, and only the private copy, which the file can't change anymore.
+ */
+static struct keymap *keymap_load(const char *path)
+{
+    const int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        fprintf(stderr, "\"%s\": ", path);
+        perror("open");
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size != sizeof(struct layout)) {
+        fprintf(stderr, "\"%s\": layout image must be exactly %zu bytes\n", path, sizeof(struct layout));
+        close(fd);
+        return NULL;
+    }
+    struct keymap *keymap = malloc(sizeof(*keymap));
+    if (keymap == NULL) {
+        perror("malloc");
+        close(fd);
+        return NULL;
+    }
+    struct layout *layout = &keymap->layout;
+    size_t done = 0;
+    while (done < sizeof(*layout)) {
+        const ssize_t len = pread(fd, (char *)layout + done, sizeof(*layout) - done, done);
+        if (len == -1 && errno == EINTR)
+            continue;
+        if (len <= 0) {
+            fprintf(stderr, "\"%s\": ", path);
+            if (len == 0)
+                fprintf(stderr, "layout image was truncated while reading\n");
+            else
+                perror("read");
+            close(fd);
+            free(keymap);
+            return NULL;
+        }
+        done += len;
+    }
+    close(fd);
+    if (memcmp(layout->magic, LAYOUT_MAGIC, sizeof(layout->magic)) != 0 ||
+            layout->version != LAYOUT_VERSION ||
+            layout->size != sizeof(*layout) ||
+            layout->keys_num > LAYOUT_KEYS_MAX ||
+            layout->macros_num > LAYOUT_MACROS_MAX ||
+            layout->steps_num > LAYOUT_MACRO_STEPS_MAX ||
+            layout->macro_first[0] != 0 ||
+            layout->macro_first[layout->macros_num] != layout->steps_num) {
+        fprintf(stderr, "\"%s\": not a layout image or unsupported version\n", path);
+        free(keymap);
+        return NULL;
+    }
+    for (uint32_t i = 0; i < layout->macros_num; i++) {
+        if (layout->macro_first[i] > layout->macro_first[i + 1]) {
+            fprintf(stderr, "\"%s\": macro %u is malformed\n", path, i);
+            free(keymap);
+            return NULL;
+        }
+    }
+    keymap->next = NULL;
+    for (uint32_t i = 0; i < layout->steps_num; i++) {
+        const struct layout_step step = layout->steps[i];
+        keymap->macro_events[i] = (struct input_event){
+            .type = step.code ? EV_KEY : EV_SYN,
+            .code = step.code ? step.code : SYN_REPORT,
+            .value = step.value,
+        };
+    }
+    return keymap;
+}
+
+static void output_key_add(uint16_t code)
+{
+    if (code < KEY_CNT)
+        g_output_keys[code / 8] |= 1 << (code % 8);
+}
+
+/*
+ * Collects the keys for the output devices. Keys can't be added to an existing
+ * uinput device, so with the layout watched every keyboard key is registered
+ * up front for the layouts to come.
+ */
+static void output_keys_init(void)
+{
+    for (uint32_t i = 0; i < g_layout->keys_num; i++) {
+        output_key_add(g_layout->keys[i]);
+    }
+    if (g_dict) {
+        /* Completions are typed letter by letter */
+        for (size_t i = 0; i < sizeof(g_letter_keys) / sizeof(g_letter_keys[0]); i++) {
+            output_key_add(g_letter_keys[i]);
+        }
+        output_key_add(KEY_BACKSPACE);
+        output_key_add(KEY_SPACE);
+    }
+    if (g_layout_watch_fd != -1) {
+        for (uint16_t code = KEY_ESC; code <= KEY_MICMUTE; code++) {
+            output_key_add(code);
+        }
+    }
+}
+
+/* Watches the directory, the file itself is usually replaced on save */
+static void layout_watch_open(const char *path)
+{
+    char dir[PATH_MAX];
+    const char *slash = strrchr(path, '/');
+    snprintf(dir, sizeof(dir), "%.*s", slash ? (int)(slash - path) + 1 : 1, slash ? path : ".");
+    g_layout_watch_fd = inotify_init1(IN_CLOEXEC);
+    if (g_layout_watch_fd == -1 || inotify_add_watch(g_layout_watch_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) == -1) {
+        fprintf(stderr, "\"%s\": ", dir);
+        perror("inotify");
+        fprintf(stderr, "Warning: layout changes won't be picked up\n");
+        if (g_layout_watch_fd != -1)
+            close(g_layout_watch_fd);
+        g_layout_watch_fd = -1;
+    }
+}
+
+/*
+ * Loads every new version of the layout file into a keymap and hands it to
+ * the input thread, see keymap_update(). Runs for as long as the process.
+ */
+static void *layout_watcher(void *arg)
+{
+    const char *path = arg;
+    const char *slash = strrchr(path, '/');
+    const char *name = slash ? slash + 1 : path;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for (;;) {
+        const ssize_t len = read(g_layout_watch_fd, buf, sizeof(buf));
+        if (len == -1 && errno == EINTR)
+            continue;
+        if (len <= 0) {
+            perror("read(inotify)");
+            return NULL;
+        }
+        bool changed = false;
+        for (ssize_t offset = 0; offset < len;) {
+            const struct inotify_event *ev = (const struct inotify_event *)&buf[offset];
+            if (ev->len && strcmp(ev->name, name) == 0)
+                changed = true;
+            offset += sizeof(*ev) + ev->len;
+        }
+        if (!changed)
+            continue;
+        struct keymap *retired = atomic_exchange(&g_keymaps_retired, NULL);
+        while (retired) {
+            struct keymap *next = retired->next;
+            keymap_free(retired);
+            retired = next;
+        }
+        struct keymap *keymap = keymap_load(path);
+        if (keymap == NULL) {
+            fprintf(stderr, "Warning: keeping the current layout\n");
+            continue;
+        }
+        for (uint32_t i = 0; i < keymap->layout.keys_num; i++) {
+            const uint16_t code = keymap->layout.keys[i];
+            if (code >= KEY_CNT || !(g_output_keys[code / 8] & (1 << (code % 8))))
+                fprintf(stderr, "Warning: key %u is not registered with the virtual keyboard, "
+                        "it works after a restart\n", code);
+        }
+        /* One the input thread hasn't taken yet is not needed anymore */
+        struct keymap *stale = atomic_exchange(&g_keymap_pending, keymap);
+        if (stale)
+            keymap_free(stale);
+        printf("Reloaded layout \"%s\"\n", path);
+        fflush(stdout);
+    }
+}
+
+static struct state release_all(struct output *out, struct state state, struct timeval timestamp)
+{
+    /*
+     * Releasing distinct keys, so they can all go in a single frame. The
+     * state is still the one of the pad in g_controllers, so keys held only
+     * by its own triggers and bumpers are released and shared ones stay.
+     */
+    uint16_t released[MODIFIERS_NUM];
+    size_t released_num = 0;
+    for (size_t m = 0; m < MODIFIERS_NUM; m++) {
+        if (!(state.keys & g_modifier_masks[m]))
+            continue;
+        const uint16_t code = g_layout->modifiers[m];
+        size_t own = 0;
+        for (size_t j = 0; j < MODIFIERS_NUM; j++) {
+            own += (state.keys & g_modifier_masks[j]) && g_layout->modifiers[j] == code;
+        }
+        bool release = modifier_holders(out, code) <= own;
+        for (size_t j = 0; release && j < released_num; j++) {
+            release = released[j] != code;
+        }
+        if (release) {
+            released[released_num++] = code;
+            emit_key_release(out, code, timestamp);
+        }
+    }
+    /* Sticks emit whole key presses, there is nothing to release for them */
+    emit_syn(out, timestamp);
+    state.keys = 0;
+    state.window_keys = 0;
+    state.window_ns = 0;
+    return state;
+}
+
+/*
+ * Switches to the keymap the watcher has prepared, if any. Called between
+ * input frames, held modifiers that have moved to other keys are pressed
+ * again under their new codes.
+ */
+static void keymap_update(void)
+{
+    if (atomic_load_explicit(&g_keymap_pending, memory_order_relaxed) == NULL)
+        return;
+    struct keymap *keymap = atomic_exchange(&g_keymap_pending, NULL);
+    const struct timeval timestamp = {0};
+    for (size_t i = 0; i < CONTROLLERS_MAX; i++) {
+        struct controller *ctl = &g_controllers[i];
+        if (!ctl->used || ctl->touchpad)
+            continue;
+        for (size_t m = 0; m < MODIFIERS_NUM; m++) {
+            const uint16_t before = g_layout->modifiers[m], after = keymap->layout.modifiers[m];
+            if (!(ctl->state.keys & g_modifier_masks[m]) || before == after)
+                continue;
+            emit_key_release(ctl->out, before, timestamp);
+            emulate_key_press(ctl->out, after, timestamp);
+        }
+        output_flush(ctl->out);
+    }
+    /* The previous keymap is freed by the watcher, off the input thread */
+    struct keymap *previous = g_keymap;
+    keymap_use(keymap);
+    memcpy(g_telemetry->chords, g_layout->chords, sizeof(g_telemetry->chords));
+    if (previous) {
+        previous->next = atomic_load(&g_keymaps_retired);
+        while (!atomic_compare_exchange_weak(&g_keymaps_retired, &previous->next, previous))
+            ;
+    }
+}
+
+/* Commits the chord at index of the layout, ev is what has triggered it */
+static void chord_fire(struct output *out, uint32_t keys, size_t index, uint64_t start_ns, struct input_event ev)
+{
+    const uint16_t code = g_layout->chords[index];
+    if (code == 0)
+        return;
+    const uint64_t now = monotonic_ns();
+    trace(TRACE_CHORD, ev.type, code, ev.value, keys, index);
+    g_telemetry->stats.chord_hits[index]++;
+    /* How long the chord takes to enter, for the layout optimizer */
+    const uint64_t end_ns = timeval_ns(ev.time);
+    if (start_ns && end_ns >= start_ns)
+        g_telemetry->stats.chord_entry_ns[index] += end_ns - start_ns;
+    if (g_frame_read_ns)
+        histogram_add(&g_telemetry->stats.latency[LATENCY_READ_TO_COMMIT], now - g_frame_read_ns);
+    if (!out->commit_ns)
+        out->commit_ns = now;
+    chord_commit(out, code, ev.time);
+}
+
+/*
+ * Commits whatever has been pressed within the window. Keys still held don't
+ * count anymore, so the next chord can be started before releasing them.
+ */
+static struct state chord_window_close(struct state state, struct output *out, struct input_event ev)
+{
+    const uint64_t start_ns = state.window_ns - (uint64_t)g_chord_window_ms * 1000000;
+    chord_fire(out, state.window_keys, chord_index(state.window_side, state.window_keys), start_ns, ev);
+    state.window_keys = 0;
+    state.window_ns = 0;
+    return state;
+}
+
+static struct state keypress(struct state state, struct input_event ev, struct output *out)
+{
+    const struct input_class *input = input_classify(ev);
+    if (state.keyboard_mode == false) {
+        if (input->kind == INPUT_MODE) {
+            state.keyboard_mode = true;
+            trace(TRACE_MODE, ev.type, ev.code, 1, state.keys, 0);
+        }
+        return state;
+    }
+    trace(TRACE_IN, ev.type, ev.code, ev.value, state.keys, 0);
+    const uint32_t chord_before = state.keys & KMASK_CHORD_KEYS;
+    if (which_side_state(state) == SIDE_NO) {
+        trace(TRACE_SIDE, ev.type, ev.code, input->side, state.keys, 0);
+        state.keys |= ((uint32_t)input->side & 3) << KMASK_SIDE_SHIFT;
+    }
+    const bool positive = ev.value > 0;
+    switch (input->kind) {
+    case INPUT_CHORD:
+        if (!(state.keys & KMASK_PRESSED))
+            state.chord_ns = timeval_ns(ev.time);
+        state.keys |= input->mask[positive] | KMASK_PRESSED;
+        break;
+    case INPUT_MODIFIER:
+        g_telemetry->stats.modifier_presses[input->modifier]++;
+        state.keys |= input->mask[positive];
+        emulate_key_press(out, g_layout->modifiers[input->modifier], ev.time);
+        break;
+    case INPUT_STICK: {
+        /* Tilted stick emits a key press, then it is auto-repeated */
+        const uint16_t code = input_stick_key(input, positive);
+        if (code)
+            emulate_key(out, code, ev.time);
+        state.keys |= input->mask[positive];
+        break;
+    }
+    case INPUT_FLAG:
+        state.keys |= input->mask[positive];
+        break;
+    case INPUT_MODE:
+        state.keyboard_mode = false;
+        state = release_all(out, state, ev.time);
+        trace(TRACE_MODE, ev.type, ev.code, 0, state.keys, 0);
+        break;
+    default:
+        break;
+    }
+    /* A new chord is being formed, it must be committed on release again */
+    if ((state.keys & KMASK_CHORD_KEYS) != chord_before)
+        state.chord_repeated = false;
+    /* The first press opens the window, its side is the side of the chord */
+    const uint32_t pressed = state.keys & KMASK_CHORD_KEYS & ~chord_before;
+    if (g_chord_window_ms && pressed) {
+        if (state.window_ns == 0) {
+            state.window_side = input->side;
+            state.window_ns = timeval_ns(ev.time) + (uint64_t)g_chord_window_ms * 1000000;
+        }
+        state.window_keys |= pressed;
+    }
+    return state;
+}
+
+static struct state keyrelease(struct state state, struct input_event ev, struct output *out)
+{
+    if (state.keyboard_mode == false) {
+        return state;
+    }
+    trace(TRACE_IN, ev.type, ev.code, ev.value, state.keys, 0);
+    const uint32_t chord_before = state.keys & KMASK_CHORD_KEYS;
+    if ((state.keys & KMASK_PRESSED) && !state.chord_repeated && !g_chord_window_ms)
+        chord_fire(out, state.keys, chord_index(which_side_state(state), state.keys), state.chord_ns, ev);
+    /* Both directions of an axis are released at once */
+    const struct input_class *input = input_classify(ev);
+    const uint32_t mask = input->mask[0] | input->mask[1];
+    switch (input->kind) {
+    case INPUT_CHORD:
+        state.keys &= ~(mask | KMASK_PRESSED);
+        break;
+    case INPUT_MODIFIER:
+        if ((state.keys & mask) && modifier_holders(out, g_layout->modifiers[input->modifier]) <= 1)
+            emulate_key_release(out, g_layout->modifiers[input->modifier], ev.time);
+        state.keys &= ~mask;
+        break;
+    case INPUT_STICK:
+    case INPUT_FLAG:
+        state.keys &= ~mask;
+        break;
+    default:
+        break;
+    }
+    /* Releasing a key of the window commits it before the deadline */
+    if (state.window_ns && (chord_before & ~state.keys & state.window_keys))
+        state = chord_window_close(state, out, ev);
+    if ((state.keys & ~(3 << KMASK_SIDE_SHIFT)) == 0) state.keys &= ~(3 << KMASK_SIDE_SHIFT);
+    if ((state.keys & KMASK_CHORD_KEYS) == 0) state.chord_repeated = false;
+    return state;
+}
+
+static int stick_axis(uint16_t code)
+{
+    for (int i = 0; i < STICK_AXES_NUM; i++) {
+        if (g_stick_axes[i] == code)
+            return i;
+    }
+    return -1;
+}
+
+static uint8_t stick_value(const struct controller *ctl, int axis)
+{
+    const int32_t value = ctl->reader.abs[g_stick_axes[axis]];
+    return value < 0 ? 0 : value > UINT8_MAX ? UINT8_MAX : value;
+}
+
+/* Returns normalized deflection of the stick axis given by its event code */
+static int32_t stick_deflection(const struct controller *ctl, uint16_t code)
+{
+    const int axis = stick_axis(code);
+    return axis < 0 ? 0 : ctl->stick_norm[axis][stick_value(ctl, axis)];
+}
+
+/*
+ * Precomputes lookup tables for the calibration, so binarization with
+ * hysteresis is a single table lookup per axis.
+ */
+static void calibration_apply(struct controller *ctl, const struct calibration *calibration)
+{
+    ctl->calibration = *calibration;
+    for (int axis = 0; axis < STICK_AXES_NUM; axis++) {
+        const int32_t center = calibration->center[axis];
+        for (int32_t value = 0; value <= UINT8_MAX; value++) {
+            const int32_t delta = value - center;
+            const int32_t range = delta > 0 ? calibration->max[axis] - center : center - calibration->min[axis];
+            int32_t norm = range > 0 ? delta * INT8_MAX / range : 0;
+            norm = norm > INT8_MAX ? INT8_MAX : norm < -INT8_MAX ? -INT8_MAX : norm;
+            ctl->stick_norm[axis][value] = norm;
+            for (int state = -1; state <= 1; state++) {
+                int8_t next = state; // Inside of the hysteresis zone
+                if (norm > ABT + ABH)
+                    next = 1;
+                else if (norm < -(ABT + ABH))
+                    next = -1;
+                else if (norm > -(ABT - ABH) && norm < ABT - ABH)
+                    next = 0;
+                ctl->stick_next[axis][state + 1][value] = next;
+            }
+        }
+    }
+}
+
+/* Applies the stored calibration of the controller, if there is one */
+static void calibration_lookup(struct controller *ctl, const char *uniq)
+{
+    for (size_t i = 0; i < g_calibrations_num; i++) {
+        if (uniq[0] && strcmp(g_calibrations[i].uniq, uniq) == 0) {
+            printf("Controller \"%s\" uses calibration of %s\n", ctl->path, uniq);
+            calibration_apply(ctl, &g_calibrations[i]);
+            return;
+        }
+    }
+    calibration_apply(ctl, &g_default_calibration);
+    snprintf(ctl->calibration.uniq, sizeof(ctl->calibration.uniq), "%s", uniq);
+}
+
+static void calibrations_load(const char *path, bool missing_ok)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        if (missing_ok && errno == ENOENT)
+            return;
+        fprintf(stderr, "\"%s\": ", path);
+        perror("fopen");
+        exit(1);
+    }
+    char line[256];
+    for (int line_num = 1; fgets(line, sizeof(line), file); line_num++) {
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+        struct calibration c = {0};
+        const int n = sscanf(line,
+                "%31s center=%hhu,%hhu,%hhu,%hhu min=%hhu,%hhu,%hhu,%hhu max=%hhu,%hhu,%hhu,%hhu dead_zone=%hhu",
+                c.uniq, &c.center[0], &c.center[1], &c.center[2], &c.center[3],
+                &c.min[0], &c.min[1], &c.min[2], &c.min[3],
+                &c.max[0], &c.max[1], &c.max[2], &c.max[3], &c.dead_zone);
+        if (n != 14) {
+            fprintf(stderr, "%s:%d: malformed calibration\n", path, line_num);
+            exit(1);
+        }
+        if (g_calibrations_num == CALIBRATIONS_MAX) {
+            fprintf(stderr, "%s:%d: too many calibrations, at most %d supported\n",
+                    path, line_num, CALIBRATIONS_MAX);
+            exit(1);
+        }
+        g_calibrations[g_calibrations_num++] = c;
+    }
+    fclose(file);
+}
+
+/* Rewrites the calibration file atomically, so a crash can't truncate it */
+static void calibrations_save(const char *path)
+{
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *file = fopen(tmp_path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "\"%s\": ", tmp_path);
+        perror("fopen");
+        return;
+    }
+    for (size_t i = 0; i < g_calibrations_num; i++) {
+        const struct calibration *c = &g_calibrations[i];
+        fprintf(file, "%s center=%u,%u,%u,%u min=%u,%u,%u,%u max=%u,%u,%u,%u dead_zone=%u\n",
+                c->uniq, c->center[0], c->center[1], c->center[2], c->center[3],
+                c->min[0], c->min[1], c->min[2], c->min[3],
+                c->max[0], c->max[1], c->max[2], c->max[3], c->dead_zone);
+    }
+    if (fclose(file) != 0 || rename(tmp_path, path) == -1) {
+        fprintf(stderr, "\"%s\": ", path);
+        perror("write");
+    }
+}
+
+/*
+ * Calibration mode takes the sticks left alone for a couple of seconds as the
+ * center and its jitter, and then the extremes reached while rotating them.
+ */
+static void calibration_sample(struct controller *ctl)
+{
+    struct calibration_sampler *sampler = &ctl->sampler;
+    const uint64_t now = monotonic_ns();
+    if (sampler->start_ns == 0) {
+        sampler->start_ns = now;
+        memset(sampler->center_min, UINT8_MAX, sizeof(sampler->center_min));
+        memset(sampler->min, UINT8_MAX, sizeof(sampler->min));
+        printf("Calibrating \"%s\": leave both sticks centered\n", ctl->path);
+    }
+    if (!sampler->rotating && now - sampler->start_ns >= CALIBRATION_CENTER_NS && sampler->count > 0) {
+        sampler->rotating = true;
+        printf("Calibrating \"%s\": rotate both sticks along the edges a few times, then quit\n", ctl->path);
+    }
+    for (int axis = 0; axis < STICK_AXES_NUM; axis++) {
+        const uint8_t value = stick_value(ctl, axis);
+        if (!sampler->rotating) {
+            sampler->sum[axis] += value;
+            if (value < sampler->center_min[axis])
+                sampler->center_min[axis] = value;
+            if (value > sampler->center_max[axis])
+                sampler->center_max[axis] = value;
+        }
+        if (value < sampler->min[axis])
+            sampler->min[axis] = value;
+        if (value > sampler->max[axis])
+            sampler->max[axis] = value;
+    }
+    if (!sampler->rotating)
+        sampler->count++;
+}
+
+/* Turns the measurements into a calibration and saves it */
+static void calibration_finish(struct controller *ctl)
+{
+    const struct calibration_sampler *sampler = &ctl->sampler;
+    const char *uniq = ctl->calibration.uniq;
+    if (!sampler->rotating) {
+        fprintf(stderr, "\"%s\": calibration has not been completed\n", ctl->path);
+        return;
+    }
+    if (uniq[0] == '\0') {
+        fprintf(stderr, "\"%s\": controller has no Uniq, calibration can't be saved\n", ctl->path);
+        return;
+    }
+    struct calibration c = { .dead_zone = ABT - ABH };
+    snprintf(c.uniq, sizeof(c.uniq), "%s", uniq);
+    for (int axis = 0; axis < STICK_AXES_NUM; axis++) {
+        c.center[axis] = (sampler->sum[axis] + sampler->count / 2) / sampler->count;
+        c.min[axis] = sampler->min[axis];
+        c.max[axis] = sampler->max[axis];
+        const int32_t range_min = c.max[axis] - c.center[axis] < c.center[axis] - c.min[axis] ?
+            c.max[axis] - c.center[axis] : c.center[axis] - c.min[axis];
+        if (range_min < ABT + ABH) {
+            fprintf(stderr, "\"%s\": axis %d barely moved, calibration is not saved\n", ctl->path, axis);
+            return;
+        }
+        /* Twice the jitter at rest, so a worn stick never presses on its own */
+        const int32_t jitter = c.center[axis] - sampler->center_min[axis] > sampler->center_max[axis] - c.center[axis] ?
+            c.center[axis] - sampler->center_min[axis] : sampler->center_max[axis] - c.center[axis];
+        const int32_t dead_zone = 2 * jitter * INT8_MAX / range_min;
+        if (dead_zone > c.dead_zone)
+            c.dead_zone = dead_zone < ABT ? dead_zone : ABT;
+    }
+    size_t i = 0;
+    while (i < g_calibrations_num && strcmp(g_calibrations[i].uniq, c.uniq) != 0)
+        i++;
+    if (i == CALIBRATIONS_MAX) {
+        fprintf(stderr, "Too many calibrations, at most %d supported\n", CALIBRATIONS_MAX);
+        return;
+    }
+    if (i == g_calibrations_num)
+        g_calibrations_num++;
+    g_calibrations[i] = c;
+    calibrations_save(g_calibration_path);
+    printf("Calibration of %s saved: center %u,%u,%u,%u dead zone %u\n",
+            c.uniq, c.center[0], c.center[1], c.center[2], c.center[3], c.dead_zone);
+}
+
+static uint64_t repeat_interval_ns(const struct repeat *repeat)
+{
+    if (repeat->axis >= ABS_CNT)
+        return UINT64_C(1000000000) / g_repeat_rate;
+    /*
+     * Rate grows linearly from a fifth of the maximum rate at the binarization
+     * threshold up to the maximum rate at full deflection.
+     */
+    const int32_t min = ABT + ABH;
+    int32_t deflection = stick_deflection(repeat->ctl, repeat->axis);
+    deflection = deflection < 0 ? -deflection : deflection;
+    deflection = deflection < min ? min : deflection > INT8_MAX ? INT8_MAX : deflection;
+    const uint64_t rate_min = g_repeat_rate / 5 ? g_repeat_rate / 5 : 1;
+    const uint64_t rate = rate_min + (g_repeat_rate - rate_min) * (deflection - min) / (INT8_MAX - min);
+    return UINT64_C(1000000000) / rate;
+}
+
+/* Arms the timerfd for the earliest pending repeat or chord window, or disarms it */
+static void timer_arm(void)
+{
+    if (g_timer_fd == -1)
+        return;
+    uint64_t next_ns = 0;
+    for (size_t i = 0; i < REPEATS_MAX; i++) {
+        if (g_repeats[i].ctl && (next_ns == 0 || g_repeats[i].next_ns < next_ns))
+            next_ns = g_repeats[i].next_ns;
+    }
+    for (size_t i = 0; i < CONTROLLERS_MAX; i++) {
+        const struct controller *ctl = &g_controllers[i];
+        if (!ctl->used || ctl->state.window_ns == 0)
+            continue;
+        /* Deadlines are on the clock of the event timestamps */
+        uint64_t window_ns = ctl->state.window_ns;
+        if (ctl->reader.clockid != CLOCK_MONOTONIC) {
+            const uint64_t now = clock_ns(ctl->reader.clockid);
+            window_ns = monotonic_ns() + (window_ns > now ? window_ns - now : 0);
+        }
+        if (next_ns == 0 || window_ns < next_ns)
+            next_ns = window_ns;
+    }
+    for (size_t i = 0; i < PENDING_MAX; i++) {
+        if (g_pending[i].next_ns && (next_ns == 0 || g_pending[i].next_ns < next_ns))
+            next_ns = g_pending[i].next_ns;
+    }
+    struct itimerspec spec = {
+        .it_value = {
+            .tv_sec = next_ns / UINT64_C(1000000000),
+            .tv_nsec = next_ns % UINT64_C(1000000000),
+        },
+    };
+    if (timerfd_settime(g_timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) == -1)
+        perror("timerfd_settime");
+}
+
+/* Repeats run on the time of the records while replaying, see replay_feed() */
+static uint64_t repeat_now_ns(void)
+{
+    return g_replay_now_ns ? g_replay_now_ns : monotonic_ns();
+}
+
+static void repeat_start(struct controller *ctl, uint32_t mask, uint16_t axis, uint16_t code)
+{
+    if (g_repeat_delay_ms == 0)
+        return;
+    struct repeat *slot = NULL;
+    for (size_t i = 0; i < REPEATS_MAX; i++) {
+        if (g_repeats[i].ctl == ctl && g_repeats[i].mask == mask) {
+            slot = &g_repeats[i];
+            break;
+        }
+        if (slot == NULL && g_repeats[i].ctl == NULL)
+            slot = &g_repeats[i];
+    }
+    if (slot == NULL)
+        return;
+    *slot = (struct repeat){
+        .ctl = ctl,
+        .mask = mask,
+        .axis = axis,
+        .code = code,
+        .next_ns = repeat_now_ns() + (uint64_t)g_repeat_delay_ms * 1000000,
+    };
+}
+
+static void repeat_stop(struct controller *ctl, uint32_t mask)
+{
+    for (size_t i = 0; i < REPEATS_MAX; i++) {
+        if (g_repeats[i].ctl == ctl && (g_repeats[i].mask & mask))
+            g_repeats[i].ctl = NULL;
+    }
+}
+
+/*
+ * Starts and stops repeats according to the state change of the controller,
+ * returns true if the timer has to be re-armed.
+ */
+static bool repeat_update(struct controller *ctl, struct state before, struct state after)
+{
+    bool changed = false;
+    for (size_t i = 0; i < STICK_AXES_NUM; i++) {
+        const uint16_t axis = g_stick_axes[i];
+        const struct input_class *input = &g_inputs[INPUT_ABS(axis)];
+        for (int positive = 0; positive < 2; positive++) {
+            const uint32_t mask = input->mask[positive];
+            if ((after.keys & mask) && !(before.keys & mask)) {
+                const uint16_t code = input_stick_key(input, positive);
+                if (code)
+                    repeat_start(ctl, mask, axis, code);
+                changed = true;
+            } else if (!(after.keys & mask) && (before.keys & mask)) {
+                repeat_stop(ctl, mask);
+                changed = true;
+            }
+        }
+    }
+    if (g_chord_repeat) {
+        const uint32_t chord_before = before.keys & (KMASK_PRESSED | KMASK_CHORD_KEYS);
+        const uint32_t chord_after = after.keys & (KMASK_PRESSED | KMASK_CHORD_KEYS);
+        if (!(after.keys & KMASK_PRESSED) && (before.keys & KMASK_PRESSED)) {
+            repeat_stop(ctl, KMASK_PRESSED);
+            changed = true;
+        } else if ((after.keys & KMASK_PRESSED) && chord_after != chord_before) {
+            repeat_start(ctl, KMASK_PRESSED, ABS_CNT, 0);
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+/* Emits every repeat that is due */
+static void repeat_step(void)
+{
+    const uint64_t now = repeat_now_ns();
+    struct timeval timestamp;
+    gettimeofday(&timestamp, NULL);
+    for (size_t i = 0; i < REPEATS_MAX; i++) {
+        struct repeat *repeat = &g_repeats[i];
+        if (repeat->ctl == NULL || repeat->next_ns > now)
+            continue;
+        struct controller *ctl = repeat->ctl;
+        if (repeat->mask == KMASK_PRESSED) {
+            /* The chord is looked up every time, as it may change while held */
+            const uint16_t code = g_layout->chords[chord_index(which_side_state(ctl->state), ctl->state.keys)];
+            if (code) {
+                chord_commit(ctl->out, code, timestamp);
+                ctl->state.chord_repeated = true;
+            }
+        } else {
+            emulate_key(ctl->out, repeat->code, timestamp);
+        }
+        repeat->next_ns += repeat_interval_ns(repeat);
+        if (repeat->next_ns <= now)
+            repeat->next_ns = now + repeat_interval_ns(repeat);
+        output_flush(ctl->out);
+    }
+}
+
+/* Commits the chord if its window is over at now_ns, on the event clock */
+static void chord_window_expire(struct controller *ctl, uint64_t now_ns)
+{
+    if (ctl->state.window_ns == 0 || now_ns < ctl->state.window_ns)
+        return;
+    const struct input_event ev = {
+        .time = {
+            .tv_sec = ctl->state.window_ns / UINT64_C(1000000000),
+            .tv_usec = ctl->state.window_ns / 1000 % 1000000,
+        },
+        .type = EV_SYN,
+    };
+    ctl->state = chord_window_close(ctl->state, ctl->out, ev);
+}
+
+/* Handles the timerfd expiration */
+static void timer_step(void)
+{
+    /* No frame is being processed, there is no read-to-commit latency */
+    g_frame_read_ns = 0;
+    for (size_t i = 0; i < CONTROLLERS_MAX; i++) {
+        struct controller *ctl = &g_controllers[i];
+        if (ctl->used && ctl->state.window_ns) {
+            chord_window_expire(ctl, clock_ns(ctl->reader.clockid));
+            output_flush(ctl->out);
+        }
+    }
+    repeat_step();
+    timer_arm();
+}
+
+static void touchpad_set_active(struct controller *ctl, bool active)
+{
+    if (ctl->state.keyboard_mode == active)
+        return;
+    if (ctl->reader.fd != -1) {
+        grab(ctl, active);
+    }
+    struct touchpad *touch = &ctl->touch;
+    if (!active && touch->click) {
+        struct timeval timestamp;
+        gettimeofday(&timestamp, NULL);
+        emit(ctl->out, EV_KEY, touch->click, 0, timestamp);
+        emit_syn(ctl->out, timestamp);
+        output_flush(ctl->out);
+        touch->click = 0;
+    }
+    touch->remainder_x = touch->remainder_y = 0;
+    touch->scroll_x = touch->scroll_y = 0;
+    ctl->state.keyboard_mode = active;
+}
+
+/* Touchpads go in and out of use along with their gamepad */
+static void touchpad_follow(const struct controller *gamepad, bool keyboard_mode)
+{
+    if (gamepad->hid[0] == '\0')
+        return;
+    for (size_t i = 0; i < CONTROLLERS_MAX; i++) {
+        struct controller *ctl = &g_controllers[i];
+        if (ctl->used && ctl->touchpad && strcmp(ctl->hid, gamepad->hid) == 0)
+            touchpad_set_active(ctl, keyboard_mode);
+    }
+}
+
+static void touchpad_event(struct controller *ctl, struct input_event ev)
+{
+    struct touchpad *touch = &ctl->touch;
+    if (ev.type == EV_KEY && ev.code == BTN_LEFT) {
+        touch->button = ev.value != 0;
+        return;
+    }
+    if (ev.type != EV_ABS)
+        return;
+    if (ev.code == ABS_MT_SLOT) {
+        touch->slot = ev.value;
+        return;
+    }
+    if (touch->slot < 0 || touch->slot >= TOUCH_SLOTS)
+        return;
+    struct touch_slot *slot = &touch->slots[touch->slot];
+    switch (ev.code) {
+    case ABS_MT_TRACKING_ID:
+        slot->down = ev.value != -1;
+        slot->fresh = true;
+        break;
+    case ABS_MT_POSITION_X:
+        slot->x = ev.value;
+        touch->samples++;
+        break;
+    case ABS_MT_POSITION_Y:
+        slot->y = ev.value;
+        touch->samples++;
+        break;
+    default:
+        break;
+    }
+}
+
+/* Applies acceleration, keeping the fraction of a pixel for the next frame */
+static int32_t touchpad_accelerate(int32_t delta, int32_t speed, int32_t *remainder)
+{
+    int32_t gain = TOUCH_GAIN + TOUCH_ACCEL * speed;
+    gain = gain > TOUCH_GAIN_MAX ? TOUCH_GAIN_MAX : gain;
+    const int32_t scaled = delta * gain + *remainder;
+    const int32_t pixels = scaled / 256;
+    *remainder = scaled - pixels * 256;
+    return pixels;
+}
+
+/*
+ * Turns the motion accumulated over the frame into a single pointer update:
+ * one finger moves the pointer, two fingers scroll, pressing the pad clicks
+ * right away, with the right button when two fingers are down.
+ */
+static void touchpad_frame(struct controller *ctl, struct timeval timestamp)
+{
+    struct touchpad *touch = &ctl->touch;
+    struct output *out = ctl->out;
+    int fingers = 0;
+    for (size_t i = 0; i < TOUCH_SLOTS; i++) {
+        fingers += touch->slots[i].down;
+    }
+    int32_t dx = 0, dy = 0;
+    int moving = 0;
+    for (size_t i = 0; i < TOUCH_SLOTS; i++) {
+        struct touch_slot *slot = &touch->slots[i];
+        /* A finger landing or lifting must not make the pointer jump */
+        if (slot->down && !slot->fresh && fingers == touch->fingers) {
+            dx += slot->x - slot->prev_x;
+            dy += slot->y - slot->prev_y;
+            moving++;
+        }
+        slot->prev_x = slot->x;
+        slot->prev_y = slot->y;
+        slot->fresh = false;
+    }
+    if (moving > 1) {
+        dx /= moving;
+        dy /= moving;
+    }
+    if (fingers != touch->fingers) {
+        touch->scroll_x = touch->scroll_y = 0;
+    }
+    touch->fingers = fingers;
+    g_telemetry->stats.touch_samples += touch->samples;
+    touch->samples = 0;
+    if (!ctl->state.keyboard_mode)
+        return;
+    if (touch->button && !touch->click) {
+        touch->click = fingers >= 2 ? BTN_RIGHT : BTN_LEFT;
+        emit(out, EV_KEY, touch->click, 1, timestamp);
+    } else if (!touch->button && touch->click) {
+        emit(out, EV_KEY, touch->click, 0, timestamp);
+        touch->click = 0;
+    }
+    if (fingers == 1 && (dx || dy)) {
+        const int32_t speed = (dx < 0 ? -dx : dx) > (dy < 0 ? -dy : dy) ? (dx < 0 ? -dx : dx) : (dy < 0 ? -dy : dy);
+        const int32_t x = touchpad_accelerate(dx, speed, &touch->remainder_x);
+        const int32_t y = touchpad_accelerate(dy, speed, &touch->remainder_y);
+        if (x)
+            emit(out, EV_REL, REL_X, x, timestamp);
+        if (y)
+            emit(out, EV_REL, REL_Y, y, timestamp);
+    } else if (fingers == 2) {
+        touch->scroll_x += dx;
+        touch->scroll_y += dy;
+        const int32_t wheel = -touch->scroll_y / TOUCH_SCROLL_STEP;
+        const int32_t hwheel = touch->scroll_x / TOUCH_SCROLL_STEP;
+        if (wheel) {
+            emit(out, EV_REL, REL_WHEEL, wheel, timestamp);
+            touch->scroll_y += wheel * TOUCH_SCROLL_STEP;
+        }
+        if (hwheel) {
+            emit(out, EV_REL, REL_HWHEEL, hwheel, timestamp);
+            touch->scroll_x -= hwheel * TOUCH_SCROLL_STEP;
+        }
+    }
+    if (out->unsynced)
+        g_telemetry->stats.touch_frames++;
+    emit_syn(out, timestamp);
+}
+
+/* Restores the multitouch state after SYN_DROPPED */
+static void touchpad_resync(struct controller *ctl)
+{
+    struct touchpad *touch = &ctl->touch;
+    ctl->reader.frame_len = 0;
+    for (size_t i = 0; i < TOUCH_SLOTS; i++) {
+        touch->slots[i].fresh = true;
+    }
+    if (ctl->reader.fd == -1)
+        return;
+    static const uint32_t codes[] = { ABS_MT_TRACKING_ID, ABS_MT_POSITION_X, ABS_MT_POSITION_Y };
+    for (size_t i = 0; i < sizeof(codes) / sizeof(codes[0]); i++) {
+        struct {
+            uint32_t code;
+            int32_t values[TOUCH_SLOTS];
+        } mt = { .code = codes[i] };
+        if (ioctl(ctl->reader.fd, EVIOCGMTSLOTS(sizeof(mt)), &mt) == -1) {
+            perror("ioctl(EVIOCGMTSLOTS)");
+            return;
+        }
+        for (size_t slot = 0; slot < TOUCH_SLOTS; slot++) {
+            if (codes[i] == ABS_MT_TRACKING_ID)
+                touch->slots[slot].down = mt.values[slot] != -1;
+            else if (codes[i] == ABS_MT_POSITION_X)
+                touch->slots[slot].x = mt.values[slot];
+            else
+                touch->slots[slot].y = mt.values[slot];
+        }
+    }
+    uint8_t keys[sizeof(ctl->reader.keys)] = {0};
+    if (ioctl(ctl->reader.fd, EVIOCGKEY(sizeof(keys)), keys) == 0)
+        touch->button = keys[BTN_LEFT / 8] & (1 << (BTN_LEFT % 8));
+}
+
+static void handle_event(struct controller *ctl, struct input_event ev)
+{
+    struct output *out = ctl->out;
+    struct state state = ctl->state;
+    switch (input_classify(ev)->kind) {
+    case INPUT_NONE:
+        break;
+    case INPUT_STICK: {
+        /*
+         * Both axes of the stick are binarized together, the radial dead
+         * zone releases them at once when the stick gets back to center.
+         */
+        const int pair = stick_axis(ev.code) & ~1;
+        int8_t next[2];
+        int32_t radius2 = 0;
+        for (int i = 0; i < 2; i++) {
+            const int axis = pair + i;
+            const uint8_t value = stick_value(ctl, axis);
+            const int32_t norm = ctl->stick_norm[axis][value];
+            radius2 += norm * norm;
+            next[i] = ctl->stick_next[axis][ctl->stick_state[axis] + 1][value];
+        }
+        if (radius2 < (int32_t)ctl->calibration.dead_zone * ctl->calibration.dead_zone) {
+            next[0] = next[1] = 0;
+        }
+        if (next[stick_axis(ev.code) - pair] == ctl->stick_state[stick_axis(ev.code)])
+            g_telemetry->stats.stick_filtered++;
+        for (int i = 0; i < 2; i++) {
+            const int axis = pair + i;
+            if (next[i] == ctl->stick_state[axis])
+                continue;
+            ev.code = g_stick_axes[axis];
+            if (ctl->stick_state[axis] != 0) {
+                ev.value = 0;
+                state = keyrelease(state, ev, out);
+            }
+            if (next[i] != 0) {
+                ev.value = next[i];
+                state = keypress(state, ev, out);
+            }
+            ctl->stick_state[axis] = next[i];
+        }
+        break;
+    }
+    default:
+        /* Buttons are 1 when pressed and 2 when autorepeated, d-pad axes are -1 or 1 */
+        if (ev.value == 0)
+            state = keyrelease(state, ev, out);
+        else if (ev.value == 1 || (ev.type == EV_ABS && ev.value == -1))
+            state = keypress(state, ev, out);
+        break;
+    }
+    if (repeat_update(ctl, ctl->state, state) || state.window_ns != ctl->state.window_ns)
+        timer_arm();
+    /* The state machine only tracks the mode, grabbing is up to the caller */
+    if (state.keyboard_mode != ctl->state.keyboard_mode && ctl->reader.fd != -1 && !ctl->hidraw)
+        grab(ctl, state.keyboard_mode);
+    if (state.keyboard_mode != ctl->state.keyboard_mode)
+        touchpad_follow(ctl, state.keyboard_mode);
+    ctl->state = state;
+}
+
+static void reader_init(struct reader *reader, int fd)
+{
+    memset(reader, 0, sizeof(*reader));
+    reader->fd = fd;
+    /* Monotonic timestamps make kernel-to-read latency immune to clock jumps */
+    int clockid = CLOCK_MONOTONIC;
+    reader->clockid = ioctl(fd, EVIOCSCLOCKID, &clockid) == 0 ? CLOCK_MONOTONIC : CLOCK_REALTIME;
+    /* Start from the actual device state rather than from all zeros */
+    ioctl(fd, EVIOCGKEY(sizeof(reader->keys)), reader->keys);
+    for (size_t i = 0; i < STICK_AXES_NUM; i++) {
+        reader->abs[g_stick_axes[i]] = INT8_MAX;
+    }
+    for (size_t i = 0; i < sizeof(g_resync_abs) / sizeof(g_resync_abs[0]); i++) {
+        struct input_absinfo absinfo;
+        if (ioctl(fd, EVIOCGABS(g_resync_abs[i]), &absinfo) == 0) {
+            reader->abs[g_resync_abs[i]] = absinfo.value;
+        }
+    }
+}
+
+/*
+ * Queries the device state after SYN_DROPPED and fills the frame with
+ * synthetic events for everything that differs from what we have seen so far,
+ * as if the dropped events were delivered in a single frame.
+ */
+static void reader_resync(struct reader *reader)
+{
+    const uint64_t now = clock_ns(reader->clockid);
+    const struct timeval timestamp = {
+        .tv_sec = now / UINT64_C(1000000000),
+        .tv_usec = now / 1000 % 1000000,
+    };
+    reader->frame_len = 0;
+    if (reader->fd == -1) {
+        /* Replaying a capture, there is no device to query */
+        return;
+    }
+    uint8_t keys[sizeof(reader->keys)] = {0};
+    if (ioctl(reader->fd, EVIOCGKEY(sizeof(keys)), keys) == -1) {
+        perror("ioctl(EVIOCGKEY)");
+    } else {
+        for (size_t code = 0; code < KEY_CNT; code++) {
+            const uint8_t bit = 1 << (code % 8);
+            if ((keys[code / 8] ^ reader->keys[code / 8]) & bit) {
+                if (reader->frame_len >= FRAME_MAX)
+                    break;
+                reader->frame[reader->frame_len++] = (struct input_event){
+                    .time = timestamp,
+                    .type = EV_KEY,
+                    .code = code,
+                    .value = (keys[code / 8] & bit) ? 1 : 0,
+                };
+            }
+        }
+    }
+    for (size_t i = 0; i < sizeof(g_resync_abs) / sizeof(g_resync_abs[0]); i++) {
+        const uint16_t code = g_resync_abs[i];
+        struct input_absinfo absinfo;
+        if (ioctl(reader->fd, EVIOCGABS(code), &absinfo) == -1) {
+            perror("ioctl(EVIOCGABS)");
+            continue;
+        }
+        if (absinfo.value != reader->abs[code] && reader->frame_len < FRAME_MAX) {
+            reader->frame[reader->frame_len++] = (struct input_event){
+                .time = timestamp,
+                .type = EV_ABS,
+                .code = code,
+                .value = absinfo.value,
+            };
+        }
+    }
+    trace(TRACE_RESYNC, EV_SYN, SYN_DROPPED, reader->frame_len, 0, 0);
+}
+
+static void reader_flush_frame(struct controller *ctl, struct timeval timestamp)
+{
+    struct reader *reader = &ctl->reader;
+    if (ctl->touchpad) {
+        for (size_t i = 0; i < reader->frame_len; i++) {
+            touchpad_event(ctl, reader->frame[i]);
+        }
+        reader->frame_len = 0;
+        touchpad_frame(ctl, timestamp);
+        output_flush(ctl->out);
+        return;
+    }
+    /* A window that is over by the time of this frame goes first */
+    chord_window_expire(ctl, timeval_ns(timestamp));
+    for (size_t i = 0; i < reader->frame_len; i++) {
+        const struct input_event ev = reader->frame[i];
+        if (ev.type == EV_KEY && ev.code < KEY_CNT) {
+            if (ev.value)
+                reader->keys[ev.code / 8] |= 1 << (ev.code % 8);
+            else
+                reader->keys[ev.code / 8] &= ~(1 << (ev.code % 8));
+        } else if (ev.type == EV_ABS && ev.code < ABS_CNT) {
+            reader->abs[ev.code] = ev.value;
+        }
+        if (!g_calibrate)
+            handle_event(ctl, ev);
+    }
+    if (g_calibrate && reader->frame_len > 0)
+        calibration_sample(ctl);
+    reader->frame_len = 0;
+    output_flush(ctl->out);
+}
+
+/* Feeds events to the controller, processing every complete SYN_REPORT frame */
+static void reader_feed(struct controller *ctl, const struct input_event *events, size_t count)
+{
+    struct reader *reader = &ctl->reader;
+    for (size_t i = 0; i < count; i++) {
+        const struct input_event ev = events[i];
+        if (ev.type == EV_SYN && ev.code == SYN_DROPPED) {
+            /* Discard everything up to and including the next SYN_REPORT */
+            reader->dropped = true;
+            reader->frame_len = 0;
+        } else if (ev.type == EV_SYN && ev.code == SYN_REPORT) {
+            if (reader->dropped) {
+                reader->dropped = false;
+                if (ctl->touchpad)
+                    touchpad_resync(ctl);
+                else
+                    reader_resync(reader);
+            }
+            reader_flush_frame(ctl, ev.time);
+        } else if (!reader->dropped && ev.type != EV_SYN) {
+            /* Touchpad samples are only coalesced, a split frame is harmless */
+            if (reader->frame_len >= FRAME_MAX)
+                reader_flush_frame(ctl, ev.time);
+            reader->frame[reader->frame_len++] = ev;
+        }
+    }
+}
+
+/* Returns the time since the previous record, writes the header if needed */
+static uint32_t capture_delta_us(uint64_t time_us)
+{
+    if (g_capture_last_us == 0) {
+        struct capture_header header = { .start_us = time_us };
+        memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+        fwrite(&header, sizeof(header), 1, g_capture);
+        g_capture_last_us = time_us;
+    }
+    const uint64_t delta_us = time_us > g_capture_last_us ? time_us - g_capture_last_us : 0;
+    g_capture_last_us = time_us;
+    return delta_us > UINT32_MAX ? UINT32_MAX : delta_us;
+}
+
+static void capture_write(size_t controller, const struct input_event *events, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        const uint64_t time_us = (uint64_t)events[i].time.tv_sec * 1000000 + (uint64_t)events[i].time.tv_usec;
+        const struct capture_record record = {
+            .delta_us = capture_delta_us(time_us),
+            .type = events[i].type,
+            .code = events[i].code,
+            .value = events[i].value,
+            .controller = controller,
+        };
+        fwrite(&record, sizeof(record), 1, g_capture);
+    }
+}
+
+/* Writes a record of the type followed by the data padded to whole records */
+static void capture_write_payload(size_t controller, uint16_t type, const void *data, size_t len, uint64_t time_us)
+{
+    const struct capture_record record = {
+        .delta_us = capture_delta_us(time_us),
+        .type = type,
+        .code = len,
+        .controller = controller,
+    };
+    uint8_t payload[(HIDRAW_REPORT_MAX + sizeof(record) - 1) / sizeof(record) * sizeof(record)] = {0};
+    memcpy(payload, data, len);
+    fwrite(&record, sizeof(record), 1, g_capture);
+    fwrite(payload, (len + sizeof(record) - 1) / sizeof(record) * sizeof(record), 1, g_capture);
+}
+
+/*
+ * Decodes USB (0x01) and Bluetooth (0x11) DS4 input reports. Both have the
+ * same layout, the Bluetooth one is just shifted by two bytes.
+ */
+static bool ds4_decode(const uint8_t *report, size_t len, struct ds4_input *input)
+{
+    static const int8_t hat[9][2] = {
+        { 0, -1 }, { 1, -1 }, { 1, 0 }, { 1, 1 }, { 0, 1 }, { -1, 1 }, { -1, 0 }, { -1, -1 }, { 0, 0 },
+    };
+    const uint8_t *data;
+    if (len >= 10 && report[0] == 0x01) {
+        data = report + 1;
+    } else if (len >= 12 && report[0] == 0x11) {
+        data = report + 3;
+    } else {
+        return false;
+    }
+    memcpy(input->axes, data, sizeof(input->axes));
+    const uint8_t direction = (data[4] & 0x0f) < 8 ? data[4] & 0x0f : 8;
+    input->hat_x = hat[direction][0];
+    input->hat_y = hat[direction][1];
+    input->buttons = (data[4] >> 4) | (data[5] << 4) | ((data[6] & 1) << 12);
+    return true;
+}
+
+/*
+ * Feeds a raw report to the controller as a single frame that contains only
+ * what has changed since the previous report, just like evdev would do.
+ */
+static void hidraw_feed(struct controller *ctl, const uint8_t *report, size_t len, struct timeval timestamp)
+{
+    static const uint16_t axes[] = { ABS_X, ABS_Y, ABS_RX, ABS_RY };
+    struct ds4_input input;
+    if (!ds4_decode(report, len, &input))
+        return;
+    if (!ctl->hid_valid) {
+        /* Sticks are somewhere around the center, the rest is released */
+        ctl->hid_previous = (struct ds4_input){0};
+        memcpy(ctl->hid_previous.axes, input.axes, sizeof(input.axes));
+        for (size_t i = 0; i < sizeof(axes) / sizeof(axes[0]); i++) {
+            ctl->reader.abs[axes[i]] = input.axes[i];
+        }
+        ctl->hid_valid = true;
+    }
+    const struct ds4_input previous = ctl->hid_previous;
+    struct input_event events[sizeof(g_ds4_buttons) / sizeof(g_ds4_buttons[0]) + 7];
+    size_t count = 0;
+    for (size_t i = 0; i < sizeof(g_ds4_buttons) / sizeof(g_ds4_buttons[0]); i++) {
+        if (((input.buttons ^ previous.buttons) >> i) & 1) {
+            events[count++] = (struct input_event){
+                .time = timestamp, .type = EV_KEY, .code = g_ds4_buttons[i], .value = (input.buttons >> i) & 1,
+            };
+        }
+    }
+    if (input.hat_x != previous.hat_x) {
+        events[count++] = (struct input_event){
+            .time = timestamp, .type = EV_ABS, .code = ABS_HAT0X, .value = input.hat_x,
+        };
+    }
+    if (input.hat_y != previous.hat_y) {
+        events[count++] = (struct input_event){
+            .time = timestamp, .type = EV_ABS, .code = ABS_HAT0Y, .value = input.hat_y,
+        };
+    }
+    for (size_t i = 0; i < sizeof(axes) / sizeof(axes[0]); i++) {
+        if (input.axes[i] != previous.axes[i]) {
+            events[count++] = (struct input_event){
+                .time = timestamp, .type = EV_ABS, .code = axes[i], .value = input.axes[i],
+            };
+        }
+    }
+    ctl->hid_previous = input;
+    if (count == 0)
+        return;
+    events[count++] = (struct input_event){ .time = timestamp, .type = EV_SYN, .code = SYN_REPORT };
+    reader_feed(ctl, events, count);
+}
+
+/* Handles a single raw report, which is what hidraw gives per read(2) call */
+static void hidraw_process(struct controller *ctl, const uint8_t *report, size_t len)
+{
+    g_frame_read_ns = monotonic_ns();
+    struct timeval timestamp = {
+        .tv_sec = g_frame_read_ns / UINT64_C(1000000000),
+        .tv_usec = g_frame_read_ns / 1000 % 1000000,
+    };
+    if (g_capture) {
+        capture_write_payload(ctl - g_controllers, CAPTURE_HIDRAW_REPORT, report, len, g_frame_read_ns / 1000);
+    }
+    hidraw_feed(ctl, report, len, timestamp);
+}
+
+/*
+ * Handles what a read into the reader buffer has returned, feeding every
+ * complete SYN_REPORT frame to the state machine.
+ */
+static void reader_process(struct controller *ctl, size_t size)
+{
+    struct reader *reader = &ctl->reader;
+    struct telemetry_controller *tc = &g_telemetry->controllers[ctl - g_controllers];
+    if (ctl->hidraw) {
+        tc->events++;
+        hidraw_process(ctl, (const uint8_t *)reader->buf, size);
+        return;
+    }
+    const size_t count = size / sizeof(reader->buf[0]);
+    tc->events += count;
+    g_frame_read_ns = monotonic_ns();
+    const uint64_t read_ns = reader->clockid == CLOCK_MONOTONIC ? g_frame_read_ns : clock_ns(reader->clockid);
+    for (size_t i = 0; i < count; i++) {
+        const struct input_event ev = reader->buf[i];
+        if (ev.type == EV_SYN && ev.code == SYN_REPORT) {
+            const uint64_t event_ns =
+                (uint64_t)ev.time.tv_sec * UINT64_C(1000000000) + (uint64_t)ev.time.tv_usec * 1000;
+            if (read_ns >= event_ns)
+                histogram_add(&g_telemetry->stats.latency[LATENCY_KERNEL_TO_READ], read_ns - event_ns);
+        }
+    }
+    if (g_capture) {
+        capture_write(ctl - g_controllers, reader->buf, count);
+    }
+    reader_feed(ctl, reader->buf, count);
+}
+
+/*
+ * Reads as many events as available, or a single report, with one read(2)
+ * call. Returns false if the device is not readable anymore, e.g. when it has
+ * been disconnected.
+ */
+static bool reader_step(struct controller *ctl)
+{
+    struct reader *reader = &ctl->reader;
+    const ssize_t ret = read(reader->fd, reader->buf, ctl->hidraw ? HIDRAW_REPORT_MAX : sizeof(reader->buf));
+    if (ret == -1) {
+        if (errno == EINTR || errno == EAGAIN)
+            return true;
+        fprintf(stderr, "\"%s\": ", ctl->path);
+        perror("read");
+        return false;
+    }
+    reader_process(ctl, ret);
+    return true;
+}
+
+static struct output *output_get(size_t index)
+{
+    struct output *out = &g_outputs[g_separate_outputs ? index : 0];
+    if (out->fd != -1)
+        return out;
+    out->fd = open("/dev/uinput", O_WRONLY);
+    if (out->fd == -1) {
+        fprintf(stderr, "\"/dev/uinput\": ");
+        perror("open");
+        exit(1);
+    }
+    setup_output_device(out->fd);
+    return out;
+}
+
+static void output_destroy(struct output *out)
+{
+    if (out->fd == -1)
+        return;
+    output_drain(out);
+    ioctl(out->fd, UI_DEV_DESTROY);
+    close(out->fd);
+    out->fd = -1;
+}
+
+static bool test_bit(const uint8_t *bits, size_t bit)
+{
+    return bits[bit / 8] & (1 << (bit % 8));
+}
+
+/*
+ * Same heuristics as in ds4-keyboard-udev-autorun.sh: the gamepad node has
+ * exactly these capabilities, unlike the touchpad and motion sensors nodes
+ * that share the same udev attributes.
+ */
+static bool is_ds4_gamepad(int fd)
+{
+    static const uint16_t keys[] = {
+        BTN_SOUTH, BTN_EAST, BTN_NORTH, BTN_WEST, BTN_TL, BTN_TR, BTN_TL2,
+        BTN_TR2, BTN_SELECT, BTN_START, BTN_MODE, BTN_THUMBL, BTN_THUMBR,
+    };
+    uint8_t ev_bits[EV_CNT / 8 + 1] = {0};
+    uint8_t key_bits[KEY_CNT / 8 + 1] = {0};
+    uint8_t abs_bits[ABS_CNT / 8 + 1] = {0};
+    uint8_t msc_bits[MSC_CNT / 8 + 1] = {0};
+    if (ioctl(fd, EVIOCGBIT(0, sizeof(ev_bits)), ev_bits) == -1 ||
+            ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(key_bits)), key_bits) == -1 ||
+            ioctl(fd, EVIOCGBIT(EV_ABS, sizeof(abs_bits)), abs_bits) == -1 ||
+            ioctl(fd, EVIOCGBIT(EV_MSC, sizeof(msc_bits)), msc_bits) == -1) {
+        return false;
+    }
+    /* ev=1b */
+    for (size_t i = 0; i < EV_CNT; i++) {
+        const bool expected = i == EV_SYN || i == EV_KEY || i == EV_ABS || i == EV_MSC;
+        if (test_bit(ev_bits, i) != expected)
+            return false;
+    }
+    /* key=7fdb000000000000 0 0 0 0 */
+    size_t keys_num = 0;
+    for (size_t i = 0; i < KEY_CNT; i++) {
+        if (test_bit(key_bits, i))
+            keys_num++;
+    }
+    if (keys_num != sizeof(keys) / sizeof(keys[0]))
+        return false;
+    for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+        if (!test_bit(key_bits, keys[i]))
+            return false;
+    }
+    /* abs=3003f */
+    for (size_t i = 0; i < ABS_CNT; i++) {
+        const bool expected = i <= ABS_RZ || i == ABS_HAT0X || i == ABS_HAT0Y;
+        if (test_bit(abs_bits, i) != expected)
+            return false;
+    }
+    /* msc=10 */
+    for (size_t i = 0; i < MSC_CNT; i++) {
+        if (test_bit(msc_bits, i) != (i == MSC_SCAN))
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Finds the HID device the node hangs off in sysfs, e.g. 0005:054C:05C4.0001.
+ * The gamepad and touchpad nodes of one DS4 share it, unlike the uniq, which
+ * is empty over USB. An event node sits under its input device, a hidraw one
+ * right under the HID device.
+ */
+static void hid_device(int fd, bool hidraw, char *name, size_t size)
+{
+    name[0] = '\0';
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISCHR(st.st_mode))
+        return;
+    char link[64];
+    snprintf(link, sizeof(link), "/sys/dev/char/%u:%u/device%s",
+            major(st.st_rdev), minor(st.st_rdev), hidraw ? "" : "/..");
+    char resolved[PATH_MAX];
+    if (realpath(link, resolved) == NULL)
+        return;
+    const char *slash = strrchr(resolved, '/');
+    snprintf(name, size, "%.*s", (int)size - 1, slash ? slash + 1 : resolved);
+}
+
+/* The touchpad node is a clickable multitouch pad of the DS4 */
+static bool is_ds4_touchpad(int fd)
+{
+    struct input_id id;
+    uint8_t prop_bits[INPUT_PROP_CNT / 8 + 1] = {0};
+    uint8_t key_bits[KEY_CNT / 8 + 1] = {0};
+    uint8_t abs_bits[ABS_CNT / 8 + 1] = {0};
+    if (ioctl(fd, EVIOCGID, &id) == -1 ||
+            ioctl(fd, EVIOCGPROP(sizeof(prop_bits)), prop_bits) == -1 ||
+            ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(key_bits)), key_bits) == -1 ||
+            ioctl(fd, EVIOCGBIT(EV_ABS, sizeof(abs_bits)), abs_bits) == -1) {
+        return false;
+    }
+    return id.vendor == DS4_VENDOR && test_bit(prop_bits, INPUT_PROP_BUTTONPAD) &&
+        test_bit(key_bits, BTN_LEFT) && test_bit(abs_bits, ABS_MT_SLOT) &&
+        test_bit(abs_bits, ABS_MT_POSITION_X) && test_bit(abs_bits, ABS_MT_POSITION_Y);
+}
+
+/*
+ * Attaches the input device as a new controller. With check set the device is
+ * silently skipped unless it looks like a DS4 gamepad. Returns 0 or an errno
+ * code, so the caller can tell a node it may not open yet from the rest.
+ */
+static int controller_open(const char *path, int epfd, bool check)
+{
+    for (size_t i = 0; i < CONTROLLERS_MAX; i++) {
+        if (g_controllers[i].used && strcmp(g_controllers[i].path, path) == 0)
+            return EEXIST;
+    }
+    size_t index = 0;
+    while (index < CONTROLLERS_MAX && g_controllers[index].used)
+        index++;
+    if (index == CONTROLLERS_MAX) {
+        fprintf(stderr, "\"%s\": too many controllers, at most %d supported\n", path, CONTROLLERS_MAX);
+        return ENOSPC;
+    }
+    const int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd == -1) {
+        const int error = errno;
+        /* Probing for a gamepad among other devices is expected to fail often */
+        if (!check) {
+            fprintf(stderr, "\"%s\": ", path);
+            perror("open");
+        }
+        return error;
+    }
+    struct hidraw_devinfo info;
+    const bool hidraw = ioctl(fd, HIDIOCGRAWINFO, &info) == 0;
+    if (hidraw && info.vendor != DS4_VENDOR) {
+        fprintf(stderr, "\"%s\": not a DS4, vendor 0x%04x\n", path, (uint16_t)info.vendor);
+        close(fd);
+        return ENODEV;
+    }
+    const bool touchpad = !hidraw && is_ds4_touchpad(fd);
+    if (touchpad && !g_touchpad_mode) {
+        if (!check)
+            fprintf(stderr, "\"%s\": a touchpad, it is used with -M only\n", path);
+        close(fd);
+        return ENODEV;
+    }
+    if (check && !hidraw && !touchpad && !is_ds4_gamepad(fd)) {
+        close(fd);
+        return ENODEV;
+    }
+    struct controller *ctl = &g_controllers[index];
+    memset(ctl, 0, sizeof(*ctl));
+    ctl->used = true;
+    snprintf(ctl->path, sizeof(ctl->path), "%s", path);
+    ctl->out = output_get(index);
+    reader_init(&ctl->reader, fd);
+    ctl->hidraw = hidraw;
+    if (hidraw) {
+        /* Reports are stamped with the time of reading */
+        ctl->reader.clockid = CLOCK_MONOTONIC;
+    }
+    char uniq[sizeof(ctl->calibration.uniq)] = "";
+    if (ioctl(fd, hidraw ? HIDIOCGRAWUNIQ(sizeof(uniq)) : EVIOCGUNIQ(sizeof(uniq)), uniq) == -1)
+        uniq[0] = '\0';
+    uniq[sizeof(uniq) - 1] = '\0';
+    calibration_lookup(ctl, uniq);
+    if (g_capture && uniq[0])
+        capture_write_payload(index, CAPTURE_UNIQ, uniq, strlen(uniq), monotonic_ns() / 1000);
+    hid_device(fd, hidraw, ctl->hid, sizeof(ctl->hid));
+    if (touchpad) {
+        /* Follows its gamepad, or works on its own if there is none */
+        bool active = true;
+        for (size_t i = 0; i < CONTROLLERS_MAX; i++) {
+            const struct controller *gamepad = &g_controllers[i];
+            if (gamepad->used && !gamepad->touchpad && ctl->hid[0] && strcmp(gamepad->hid, ctl->hid) == 0)
+                active = gamepad->state.keyboard_mode;
+        }
+        ctl->touchpad = true;
+        ctl->touch.slot = 0;
+        touchpad_set_active(ctl, active);
+    }
+    /* The io_uring loop posts the reads itself and has no epfd */
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = ctl };
+    if (epfd != -1 && epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        const int error = errno;
+        perror("epoll_ctl(EPOLL_CTL_ADD)");
+        close(fd);
+        ctl->used = false;
+        return error;
+    }
+    g_controllers_num++;
+    printf("Controller \"%s\" attached\n", path);
+    return 0;
+}
+
+static void controller_close(struct controller *ctl, int epfd)
+{
+    repeat_stop(ctl, UINT32_MAX);
+    timer_arm();
+    if (g_calibrate && !ctl->touchpad)
+        calibration_finish(ctl);
+    if (ctl->touchpad)
+        touchpad_set_active(ctl, false);
+    if (ctl->state.keyboard_mode) {
+        struct timeval timestamp;
+        gettimeofday(&timestamp, NULL);
+        ctl->state = release_all(ctl->out, ctl->state, timestamp);
+        output_flush(ctl->out);
+        /* May fail if the device is gone already, which is fine */
+        ioctl(ctl->reader.fd, EVIOCGRAB, (void *)0);
+    }
+    if (epfd != -1)
+        epoll_ctl(epfd, EPOLL_CTL_DEL, ctl->reader.fd, NULL);
+#ifdef USE_IO_URING
+    if (g_uring.fd != -1)
+        uring_read_cancel(ctl);
+#endif
+    close(ctl->reader.fd);
+    /* The output stays for the next controller, see g_output_name */
+    ctl->used = false;
+    g_controllers_num--;
+    printf("Controller \"%s\" detached\n", ctl->path);
+}
+
+/*
+ * Opens the kernel uevent netlink socket, or binds a unix datagram socket at
+ * fake_path, which accepts messages in the very same format. The latter is
+ * meant for testing hotplug without any hardware.
+ */
+static int uevent_open(const char *fake_path)
+{
+    int fd;
+    g_uevent_fake = fake_path != NULL;
+    if (fake_path) {
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", fake_path);
+        fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        unlink(fake_path);
+        if (fd == -1 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+            fprintf(stderr, "\"%s\": ", fake_path);
+            perror("bind");
+            exit(1);
+        }
+    } else {
+        struct sockaddr_nl addr = {
+            .nl_family = AF_NETLINK,
+            .nl_groups = 1, // Kernel events, no need to wait for udev
+        };
+        fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+        if (fd == -1 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+            perror("netlink uevent socket");
+            exit(1);
+        }
+    }
+    return fd;
+}
+
+/* Attaches gamepads that had been connected before the program started */
+static void uevent_coldplug(int epfd)
+{
+    DIR *dir = opendir("/dev/input");
+    if (dir == NULL) {
+        perror("opendir(\"/dev/input\")");
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, "event", 5) != 0)
+            continue;
+        char path[128];
+        snprintf(path, sizeof(path), "/dev/input/%.64s", entry->d_name);
+        controller_open(path, epfd, true);
+    }
+    closedir(dir);
+}
+
+static void pending_add(const char *path)
+{
+    struct pending *slot = NULL;
+    for (size_t i = 0; i < PENDING_MAX; i++) {
+        if (g_pending[i].next_ns && strcmp(g_pending[i].path, path) == 0)
+            return;
+        if (slot == NULL && g_pending[i].next_ns == 0)
+            slot = &g_pending[i];
+    }
+    if (slot == NULL) {
+        fprintf(stderr, "\"%s\": no access yet and too many nodes waiting for it\n", path);
+        return;
+    }
+    snprintf(slot->path, sizeof(slot->path), "%s", path);
+    slot->attempts = 0;
+    slot->next_ns = monotonic_ns() + PENDING_FIRST_NS;
+    timer_arm();
+}
+
+/*
+ * Handles uevent messages in the "ACTION@DEVPATH\0KEY=VALUE\0..." format and
+ * attaches every newly added gamepad. Removal is detected by the read error on
+ * the device itself.
+ */
+static void uevent_step(int epfd)
+{
+    while (1) {
+        /* Any process may send to the netlink group, only the kernel is trusted */
+        struct sockaddr_nl sender = { 0 };
+        struct iovec iov = { .iov_base = g_uevent_buf, .iov_len = sizeof(g_uevent_buf) - 1 };
+        struct msghdr msg = {
+            .msg_name = g_uevent_fake ? NULL : &sender,
+            .msg_namelen = g_uevent_fake ? 0 : sizeof(sender),
+            .msg_iov = &iov,
+            .msg_iovlen = 1,
+        };
+        const ssize_t len = recvmsg(g_uevent_fd, &msg, 0);
+        if (len <= 0) {
+            if (len == -1 && errno != EAGAIN && errno != EINTR)
+                perror("recvmsg(uevent)");
+            return;
+        }
+        if (!g_uevent_fake && (msg.msg_namelen != sizeof(sender) || sender.nl_pid != 0))
+            continue;
+        g_uevent_buf[len] = '\0';
+        const char *action = NULL, *subsystem = NULL, *devname = NULL;
+        for (ssize_t i = 0; i < len; i += strlen(g_uevent_buf + i) + 1) {
+            const char *field = g_uevent_buf + i;
+            if (strncmp(field, "ACTION=", 7) == 0)
+                action = field + 7;
+            else if (strncmp(field, "SUBSYSTEM=", 10) == 0)
+                subsystem = field + 10;
+            else if (strncmp(field, "DEVNAME=", 8) == 0)
+                devname = field + 8;
+        }
+        if (!action || !subsystem || !devname || strcmp(action, "add") != 0 ||
+                strcmp(subsystem, "input") != 0) {
+            continue;
+        }
+        /*
+         * Only plain event nodes are attached. The fake source of -U may give
+         * absolute paths to arbitrary nodes, its socket is bound by the same
+         * user and isn't writable by others under the usual umask.
+         */
+        char path[128];
+        const size_t digits = strncmp(devname, "input/event", 11) == 0 ? strspn(devname + 11, "0123456789") : 0;
+        if (g_uevent_fake && devname[0] == '/') {
+            snprintf(path, sizeof(path), "%s", devname);
+        } else if (digits > 0 && digits <= 10 && devname[11 + digits] == '\0') {
+            snprintf(path, sizeof(path), "/dev/%s", devname);
+        } else {
+            continue;
+        }
+        const int error = controller_open(path, epfd, true);
+        if (error == EACCES || error == EPERM)
+            pending_add(path);
+    }
+}
+
+/* Retries the nodes that are due, called when the timerfd fires */
+static void pending_step(int epfd)
+{
+    const uint64_t now = monotonic_ns();
+    for (size_t i = 0; i < PENDING_MAX; i++) {
+        struct pending *p = &g_pending[i];
+        if (p->next_ns == 0 || p->next_ns > now)
+            continue;
+        const int error = controller_open(p->path, epfd, true);
+        const bool denied = error == EACCES || error == EPERM;
+        if (denied && ++p->attempts < PENDING_ATTEMPTS) {
+            p->next_ns = now + (PENDING_FIRST_NS << p->attempts);
+            continue;
+        }
+        if (denied)
+            fprintf(stderr, "\"%s\": open: %s\n", p->path, strerror(error));
+        p->next_ns = 0;
+    }
+    timer_arm();
+}
+
+/* Waits for input with epoll and reads it with plain read(2) calls */
+static void epoll_loop(int epfd)
+{
+    while (!g_should_stop && (g_controllers_num > 0 || g_uevent_fd != -1)) {
+        struct epoll_event events[EPOLL_EVENTS_MAX];
+        const int count = epoll_wait(epfd, events, EPOLL_EVENTS_MAX, -1);
+        if (g_should_dump_stats) {
+            g_should_dump_stats = false;
+            stats_dump(&g_telemetry->stats);
+        }
+        if (count == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            exit(1);
+        }
+        telemetry_begin();
+        keymap_update();
+        for (int i = 0; i < count; i++) {
+            if (events[i].data.ptr == &g_uevent_fd) {
+                uevent_step(epfd);
+                continue;
+            }
+            if (events[i].data.ptr == &g_timer_fd) {
+                uint64_t expirations;
+                if (read(g_timer_fd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN)
+                    perror("read(timerfd)");
+                STEADY_BEGIN();
+                timer_step();
+                STEADY_END();
+                pending_step(epfd);
+                continue;
+            }
+            struct controller *ctl = events[i].data.ptr;
+            if (!ctl->used)
+                continue;
+            STEADY_BEGIN();
+            const bool ok = reader_step(ctl);
+            STEADY_END();
+            if (!ok || ctl->grab_failed || (events[i].events & (EPOLLERR | EPOLLHUP))) {
+                controller_close(ctl, epfd);
+            }
+        }
+        telemetry_end();
+    }
+}
+
+#ifdef USE_IO_URING
+/*
+ * Same as epoll_loop(), but every iteration is a single io_uring_enter(2)
+ * that writes the output of the previous completions, re-posts the reads and
+ * waits for the next completions. There is no epfd, controllers are opened
+ * and closed with -1 for it.
+ */
+static void uring_loop(void)
+{
+    const int epfd = -1;
+    while (!g_should_stop && (g_controllers_num > 0 || g_uevent_fd != -1)) {
+        for (size_t i = 0; i < CONTROLLERS_MAX; i++) {
+            if (g_controllers[i].used && !g_uring.read_posted[i])
+                uring_read_post(&g_controllers[i]);
+            if (g_outputs[i].fd != -1)
+                uring_write_submit(&g_outputs[i]);
+        }
+        if (!g_uring.timer_posted) {
+            uring_read(IORING_OP_READ, g_timer_fd, &g_uring.timer_expirations,
+                    sizeof(g_uring.timer_expirations), URING_DATA(URING_TIMER, 0, 0));
+            g_uring.timer_posted = true;
+        }
+        if (g_uevent_fd != -1 && !g_uring.uevent_posted) {
+            struct io_uring_sqe *sqe = uring_sqe(IORING_OP_POLL_ADD, g_uevent_fd, URING_DATA(URING_UEVENT, 0, 0));
+            sqe->poll32_events = EPOLLIN;
+            g_uring.uevent_posted = true;
+        }
+        /*
+         * Write completions count towards min_complete, so they are waited
+         * for along with the input, unless more output is staged behind them.
+         */
+        unsigned wait = 1;
+        bool staged = false;
+        for (size_t i = 0; i < CONTROLLERS_MAX; i++) {
+            wait += g_outputs[i].ring_in_flight;
+            staged |= g_outputs[i].ring_in_flight && g_outputs[i].ring_len[g_outputs[i].ring_staging] > 0;
+        }
+        const int ret = uring_enter(staged ? 1 : wait);
+        if (g_should_dump_stats) {
+            g_should_dump_stats = false;
+            stats_dump(&g_telemetry->stats);
+        }
+        if (ret == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("io_uring_enter");
+            exit(1);
+        }
+        telemetry_begin();
+        keymap_update();
+        uring_reap();
+        /* Handling may wait for writes and reap more, those are handled too */
+        for (size_t i = 0; i < g_uring.completions_num; i++) {
+            const struct io_uring_cqe cqe = g_uring.completions[i];
+            const size_t index = URING_INDEX(cqe.user_data);
+            switch (URING_KIND(cqe.user_data)) {
+            case URING_UEVENT:
+                g_uring.uevent_posted = false;
+                uevent_step(epfd);
+                break;
+            case URING_TIMER:
+                g_uring.timer_posted = false;
+                if (cqe.res == -EAGAIN) {
+                    g_uring.poll_first = true;
+                    break;
+                }
+                if (cqe.res < 0 && cqe.res != -EINTR)
+                    fprintf(stderr, "read(timerfd): %s\n", strerror(-cqe.res));
+                STEADY_BEGIN();
+                timer_step();
+                STEADY_END();
+                pending_step(epfd);
+                break;
+            case URING_READ: {
+                struct controller *ctl = &g_controllers[index];
+                /* Left from a controller that has been detached since */
+                if (URING_GEN(cqe.user_data) != g_uring.generation[index])
+                    break;
+                g_uring.read_posted[index] = false;
+                if (cqe.res == -EAGAIN) {
+                    g_uring.poll_first = true;
+                    break;
+                }
+                if (cqe.res == -EINTR)
+                    break;
+                if (cqe.res <= 0) {
+                    if (cqe.res < 0)
+                        fprintf(stderr, "\"%s\": read: %s\n", ctl->path, strerror(-cqe.res));
+                    controller_close(ctl, epfd);
+                    break;
+                }
+                STEADY_BEGIN();
+                reader_process(ctl, cqe.res);
+                STEADY_END();
+                if (ctl->grab_failed)
+                    controller_close(ctl, epfd);
+                break;
+            }
+            }
+        }
+        g_uring.completions_num = 0;
+        telemetry_end();
+    }
+}
+#endif
+
+static int output_print(FILE *stream)
+{
+    int lines = 0;
+    for (size_t i = 0; i < CONTROLLERS_MAX; i++) {
+        const struct output *out = &g_outputs[i];
+        for (size_t j = 0; out->sink && j < out->sink_len; j++, lines++) {
+            fprintf(stream, "%zu %u %u %d\n", i, out->sink[j].type, out->sink[j].code, out->sink[j].value);
+        }
+    }
+    return lines;
+}
+
+/*
+ * Compares outputs of the replay with a golden file, which is in the same
+ * format as produced by the -o option. Returns zero when they are identical.
+ */
+static int golden_compare(const char *golden_path, const char *actual, size_t actual_size)
+{
+    FILE *golden = fopen(golden_path, "r");
+    if (golden == NULL) {
+        fprintf(stderr, "\"%s\": ", golden_path);
+        perror("fopen");
+        return 1;
+    }
+    FILE *actual_stream = fmemopen((void *)actual, actual_size, "r");
+    char expected_line[128], actual_line[128];
+    int line = 1;
+    int result = 0;
+    while (1) {
+        char *e = fgets(expected_line, sizeof(expected_line), golden);
+        char *a = fgets(actual_line, sizeof(actual_line), actual_stream);
+        if (e == NULL && a == NULL)
+            break;
+        if (e == NULL || a == NULL || strcmp(e, a) != 0) {
+            fprintf(stderr, "Output differs from \"%s\" at line %d:\n", golden_path, line);
+            fprintf(stderr, "  expected: %s", e ? e : "<end of file>\n");
+            fprintf(stderr, "  actual:   %s", a ? a : "<end of output>\n");
+            result = 1;
+            break;
+        }
+        line++;
+    }
+    fclose(actual_stream);
+    fclose(golden);
+    return result;
+}
+
+/*
+ * Loads a capture recorded with the -r option and attaches a controller with
+ * its output going to memory for every controller found in it. Returns the
+ * number of records, events[i] is the event of records[i].
+ */
+static ssize_t replay_load(const char *capture_path, struct capture_record **records_out,
+        struct input_event **events_out, size_t *events_num_out)
+{
+    FILE *capture = fopen(capture_path, "rb");
+    if (capture == NULL) {
+        fprintf(stderr, "\"%s\": ", capture_path);
+        perror("fopen");
+        return -1;
+    }
+    struct capture_header header;
+    if (fread(&header, sizeof(header), 1, capture) != 1 ||
+            memcmp(header.magic, CAPTURE_MAGIC, sizeof(header.magic)) != 0) {
+        fprintf(stderr, "\"%s\": not a capture file\n", capture_path);
+        fclose(capture);
+        return -1;
+    }
+    size_t count = 0, cap = 4096;
+    struct capture_record *records = malloc(cap * sizeof(records[0]));
+    while (records && fread(&records[count], sizeof(records[0]), 1, capture) == 1) {
+        if (++count == cap) {
+            cap *= 2;
+            records = realloc(records, cap * sizeof(records[0]));
+        }
+    }
+    fclose(capture);
+    struct input_event *events = malloc((count + 1) * sizeof(events[0]));
+    if (records == NULL || events == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    uint64_t time_us = header.start_us;
+    size_t events_num = 0;
+    for (size_t i = 0; i < count; i++) {
+        time_us += records[i].delta_us;
+        events_num++;
+        events[i] = (struct input_event){
+            .time = { .tv_sec = time_us / 1000000, .tv_usec = time_us % 1000000 },
+            .type = records[i].type,
+            .code = records[i].code,
+            .value = records[i].value,
+        };
+        const size_t index = records[i].controller;
+        if (index >= CONTROLLERS_MAX) {
+            fprintf(stderr, "\"%s\": record %zu has bad controller index %zu\n", capture_path, i, index);
+            return -1;
+        }
+        struct controller *ctl = &g_controllers[index];
+        char uniq[sizeof(ctl->calibration.uniq)] = "";
+        if (records[i].type == CAPTURE_HIDRAW_REPORT || records[i].type == CAPTURE_UNIQ) {
+            const size_t units = (records[i].code + sizeof(records[0]) - 1) / sizeof(records[0]);
+            const size_t max = records[i].type == CAPTURE_UNIQ ? sizeof(uniq) - 1 : HIDRAW_REPORT_MAX;
+            if (records[i].code > max || i + units >= count) {
+                fprintf(stderr, "\"%s\": record %zu has bad payload length\n", capture_path, i);
+                return -1;
+            }
+            if (records[i].type == CAPTURE_UNIQ)
+                memcpy(uniq, &records[i + 1], records[i].code);
+            else
+                ctl->hidraw = true;
+            events[i + units] = events[i];
+            i += units;
+        }
+        if (records[i].type == EV_ABS && records[i].code >= ABS_MT_SLOT && !ctl->touchpad) {
+            ctl->touchpad = true;
+            ctl->state.keyboard_mode = true;
+        }
+        if (!ctl->used) {
+            ctl->used = true;
+            snprintf(ctl->path, sizeof(ctl->path), "%s", capture_path);
+            reader_init(&ctl->reader, -1);
+            ctl->reader.clockid = CLOCK_MONOTONIC;
+            calibration_apply(ctl, &g_default_calibration);
+            ctl->out = &g_outputs[g_separate_outputs ? index : 0];
+            ctl->out->sink_cap = count * 4 + OUTPUT_MAX;
+            ctl->out->sink = malloc(ctl->out->sink_cap * sizeof(ctl->out->sink[0]));
+            if (ctl->out->sink == NULL) {
+                perror("malloc");
+                return -1;
+            }
         }
+        if (uniq[0])
+            calibration_lookup(ctl, uniq);
     }
-    if (ev.type == EV_KEY) {
-        switch (ev.code) {
-        case BTN_SOUTH:
-            state.keys &= ~KMASK_SOUTH;
-            state.keys &= ~KMASK_PRESSED;
+    *records_out = records;
+    *events_out = events;
+    *events_num_out = events_num;
+    return count;
+}
+
+/* Feeds the records from begin up to at least end, returns where it has stopped */
+static size_t replay_feed(const struct capture_record *records, const struct input_event *events,
+        size_t begin, size_t end)
+{
+    size_t i = begin;
+    for (; i < end; i++) {
+        struct controller *ctl = &g_controllers[records[i].controller];
+        /* Repeats due before the record fire first, as the timer would have */
+        const uint64_t now_ns = timeval_ns(events[i].time);
+        for (;;) {
+            uint64_t next_ns = 0;
+            for (size_t r = 0; r < REPEATS_MAX; r++) {
+                if (g_repeats[r].ctl && (next_ns == 0 || g_repeats[r].next_ns < next_ns))
+                    next_ns = g_repeats[r].next_ns;
+            }
+            if (next_ns == 0 || next_ns > now_ns)
+                break;
+            g_replay_now_ns = next_ns;
+            repeat_step();
+        }
+        g_replay_now_ns = now_ns;
+        if (records[i].type == CAPTURE_HIDRAW_REPORT) {
+            hidraw_feed(ctl, (const uint8_t *)&records[i + 1], records[i].code, events[i].time);
+            i += (records[i].code + sizeof(records[0]) - 1) / sizeof(records[0]);
+        } else if (records[i].type == CAPTURE_UNIQ) {
+            i += (records[i].code + sizeof(records[0]) - 1) / sizeof(records[0]);
+        } else {
+            reader_feed(ctl, &events[i], 1);
+        }
+    }
+    return i;
+}
+
+/*
+ * Feeds a capture through the same binarization and state machine as the
+ * real devices, with outputs going to memory.
+ */
+static int replay(const char *capture_path, const char *output_path, const char *golden_path)
+{
+    struct capture_record *records;
+    struct input_event *events;
+    size_t events_num;
+    const ssize_t count = replay_load(capture_path, &records, &events, &events_num);
+    if (count == -1)
+        return 1;
+    const uint64_t start_ns = monotonic_ns();
+    STEADY_BEGIN();
+    replay_feed(records, events, 0, count);
+    /* Windows still open would have been closed by the timer */
+    for (size_t i = 0; i < CONTROLLERS_MAX; i++) {
+        if (g_controllers[i].used)
+            chord_window_expire(&g_controllers[i], UINT64_MAX);
+    }
+    STEADY_END();
+    const uint64_t elapsed_ns = monotonic_ns() - start_ns;
+    for (size_t i = 0; i < CONTROLLERS_MAX; i++) {
+        if (g_outputs[i].sink)
+            output_flush(&g_outputs[i]);
+    }
+    printf("Replayed %zu events in %" PRIu64 " ns: %.0f events/sec, %.1f ns/event\n",
+            events_num,
+            elapsed_ns,
+            elapsed_ns ? events_num * 1e9 / elapsed_ns : 0.0,
+            events_num ? (double)elapsed_ns / events_num : 0.0);
+
+    char *text = NULL;
+    size_t text_size = 0;
+    FILE *stream = open_memstream(&text, &text_size);
+    const int lines = output_print(stream);
+    fclose(stream);
+    printf("Produced %d output events\n", lines);
+    int result = 0;
+#ifdef RTCHECK
+    printf("Allocations and stdio calls while handling input: %" PRIu64 "%s%s\n",
+            g_steady_violations, g_steady_violation ? ", the first one is " : "",
+            g_steady_violation ? g_steady_violation : "");
+    if (g_steady_violations)
+        result = 1;
+#endif
+    if (output_path) {
+        FILE *output = fopen(output_path, "w");
+        if (output == NULL) {
+            fprintf(stderr, "\"%s\": ", output_path);
+            perror("fopen");
+            result = 1;
+        } else {
+            fwrite(text, 1, text_size, output);
+            fclose(output);
+        }
+    }
+    if (golden_path && golden_compare(golden_path, text, text_size) != 0) {
+        result = 1;
+    }
+    free(text);
+    free(events);
+    free(records);
+    return result;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *capture_path = NULL;
+    const char *replay_path = NULL;
+    const char *output_path = NULL;
+    const char *golden_path = NULL;
+    int opt;
+    const char *layout_path = NULL;
+    const char *dict_path = NULL;
+    bool monitor = false;
+    const char *fake_uevent_path = NULL;
+    while ((opt = getopt(argc, argv, "sv:r:p:o:g:mMU:l:w:P:D:R:CW:k:Kt:a:T:N:I:")) != -1) {
+        switch (opt) {
+        case 's':
+            g_separate_outputs = true;
             break;
-        case BTN_EAST:
-            state.keys &= ~KMASK_EAST;
-            state.keys &= ~KMASK_PRESSED;
+        case 'v':
+            g_verbosity = atoi(optarg);
             break;
-        case BTN_WEST:
-            state.keys &= ~KMASK_WEST;
-            state.keys &= ~KMASK_PRESSED;
+        case 'r':
+            capture_path = optarg;
             break;
-        case BTN_NORTH:
-            state.keys &= ~KMASK_NORTH;
-            state.keys &= ~KMASK_PRESSED;
+        case 'p':
+            replay_path = optarg;
             break;
-        case BTN_TL2:
-            // Control
-            if (state.keys & KMASK_LT) {
-                emulate_key_release(ofd, KEY_LEFTCTRL, ev.time);
-            }
-            state.keys &= ~KMASK_LT;
+        case 'o':
+            output_path = optarg;
             break;
-        case BTN_TR2:
-            // Shift
-            if (state.keys & KMASK_RT) {
-                emulate_key_release(ofd, KEY_LEFTSHIFT, ev.time);
-            }
-            state.keys &= ~KMASK_RT;
+        case 'g':
+            golden_path = optarg;
             break;
-        case BTN_TL:
-            // Super
-            if (state.keys & KMASK_LB) {
-                emulate_key_release(ofd, KEY_LEFTMETA, ev.time);
-            }
-            state.keys &= ~KMASK_LB;
+        case 'm':
+            monitor = true;
             break;
-        case BTN_TR:
-            // Alt
-            if (state.keys & KMASK_RB) {
-                emulate_key_release(ofd, KEY_LEFTALT, ev.time);
+        case 'M':
+            g_touchpad_mode = true;
+            break;
+        case 'l':
+            layout_path = optarg;
+            break;
+        case 'w':
+            dict_path = optarg;
+            break;
+        case 't':
+            g_rt_priority = atoi(optarg);
+            if (g_rt_priority < sched_get_priority_min(SCHED_FIFO) ||
+                    g_rt_priority > sched_get_priority_max(SCHED_FIFO)) {
+                fprintf(stderr, "Error: SCHED_FIFO priority must be within %d..%d\n",
+                        sched_get_priority_min(SCHED_FIFO), sched_get_priority_max(SCHED_FIFO));
+                exit(1);
             }
-            state.keys &= ~KMASK_RB;
             break;
-        case BTN_SELECT:
-            state.keys &= ~KMASK_SHARE;
+        case 'a':
+            g_rt_cpu = atoi(optarg);
             break;
-        case BTN_START:
-            state.keys &= ~KMASK_OPTIONS;
+        case 'P':
+            g_macro_pace_us = strtoul(optarg, NULL, 0);
             break;
-        case BTN_MODE:
+        case 'D':
+            g_repeat_delay_ms = strtoul(optarg, NULL, 0);
             break;
-        };
-    } else if (ev.type == EV_ABS) {
-        /*
-         * d-pad is EV_ABS
-         * left-right: code ABS_HAT0X, left=-1, right=1
-         * down-up: code ABS_HAT0Y, up=-1, down=1
-         */
-        if (ev.code == ABS_HAT0X) {
-            state.keys &= ~(KMASK_LEFT | KMASK_RIGHT);
-            /* D-pad takes part in chords too */
-            state.keys &= ~KMASK_PRESSED;
-        } else if (ev.code == ABS_HAT0Y) {
-            state.keys &= ~(KMASK_UP | KMASK_DOWN);
-            /* D-pad takes part in chords too */
-            state.keys &= ~KMASK_PRESSED;
-        } else if (ev.code == ABS_X) {
-            if (state.keys & KMASK_THUMBL_LEFT)
-                emulate_key_release(ofd, KEY_LEFT, ev.time);
-            else if (state.keys & KMASK_THUMBL_RIGHT)
-                emulate_key_release(ofd, KEY_RIGHT, ev.time);
-            state.keys &= ~(KMASK_THUMBL_LEFT | KMASK_THUMBL_RIGHT);
-        } else if (ev.code == ABS_Y) {
-            if (state.keys & KMASK_THUMBL_UP)
-                emulate_key_release(ofd, KEY_UP, ev.time);
-            else if (state.keys & KMASK_THUMBL_DOWN)
-                emulate_key_release(ofd, KEY_DOWN, ev.time);
-            state.keys &= ~(KMASK_THUMBL_UP | KMASK_THUMBL_DOWN);
-        } else if (ev.code == ABS_RX) {
-            state.keys &= ~(KMASK_THUMBR_LEFT | KMASK_THUMBR_RIGHT);
-        } else if (ev.code == ABS_RY) {
-            state.keys &= ~(KMASK_THUMBR_UP | KMASK_THUMBR_DOWN);
+        case 'R':
+            g_repeat_rate = strtoul(optarg, NULL, 0);
+            if (g_repeat_rate == 0)
+                g_repeat_rate = 1;
+            break;
+        case 'C':
+            g_chord_repeat = true;
+            break;
+        case 'W':
+            g_chord_window_ms = strtoul(optarg, NULL, 0);
+            break;
+        case 'k':
+            g_calibration_path = optarg;
+            break;
+        case 'K':
+            g_calibrate = true;
+            break;
+        case 'T':
+            g_telemetry_path = optarg;
+            break;
+        case 'N':
+            g_output_name = optarg;
+            break;
+        case 'I': {
+            unsigned vendor, product;
+            if (sscanf(optarg, "%x:%x", &vendor, &product) != 2 || vendor > 0xffff || product > 0xffff) {
+                fprintf(stderr, "Error: -I takes hexadecimal vendor:product, e.g. 1234:5678\n");
+                exit(1);
+            }
+            g_output_vendor = vendor;
+            g_output_product = product;
+            break;
+        }
+        case 'U':
+            monitor = true;
+            fake_uevent_path = optarg;
+            break;
+        default:
+            fprintf(stderr,
+                    "Usage: %s [-s] [-v verbosity] [-l layout] [-w dictionary] [-r capture] [-m | -U socket] [-M]\n"
+                    "          [-D repeat delay ms, 0 for none] [-R repeat rate] [-C] [-W chord window ms]\n"
+                    "          [-k calibration [-K]] [-P macro pace us] [-t realtime priority [-a cpu]]\n"
+                    "          [-T telemetry page] [-N keyboard name] [-I vendor:product]\n"
+                    "          [input device]...\n"
+                    "       %s [-s] [-l layout] [-w dictionary] [-W chord window ms] [-D repeat delay ms]\n"
+                    "          [-R repeat rate] [-C] [-k calibration] -p capture [-o output] [-g golden]\n",
+                    argv[0], argv[0]);
+            exit(1);
         }
     }
-    if ((state.keys & ~(3 << KMASK_SIDE_SHIFT)) == 0) state.keys &= ~(3 << KMASK_SIDE_SHIFT);
-    return state;
-}
-
-int main(int argc, char *argv[])
-{
-    if (argc < 2) {
+    for (size_t i = 0; i < CONTROLLERS_MAX; i++) {
+        g_outputs[i].fd = -1;
+    }
+    if (build_builtin_layout() != 0) {
+        fprintf(stderr, "Warning: mapping table has problems, see above\n");
+    }
+    if (layout_path) {
+        struct keymap *keymap = keymap_load(layout_path);
+        if (keymap == NULL)
+            exit(1);
+        keymap_use(keymap);
+    }
+    if (dict_path) {
+        g_dict = dict_load(dict_path);
+        if (g_dict == NULL)
+            exit(1);
+    }
+    if (g_calibrate && g_calibration_path == NULL) {
+        fprintf(stderr, "Error: -K requires a calibration file given with -k\n");
+        exit(1);
+    }
+    if (g_calibration_path) {
+        /* Calibration mode creates the file */
+        calibrations_load(g_calibration_path, g_calibrate);
+    }
+    if (g_telemetry_path) {
+        /* Replay leaves the page behind for the layout optimizer, see layoutc -O */
+        telemetry_open(g_telemetry_path);
+    }
+    if (replay_path) {
+        /* Tracing would only skew the measurements */
+        g_verbosity = 0;
+        return replay(replay_path, output_path, golden_path);
+    }
+    if (optind >= argc && !monitor) {
         fprintf(stderr, "Error: No input device specified\n");
         exit(1);
     }
-    const char *input_path = argv[1];
-    g_ifd = open(input_path, O_RDONLY);
-    if (g_ifd == -1) {
-        fprintf(stderr, "\"%s\": ", input_path);
-        perror("open");
+    if (g_rt_cpu >= 0 && g_rt_priority == 0) {
+        fprintf(stderr, "Error: -a works only in realtime mode, enable it with -t\n");
         exit(1);
     }
-    int ofd = open("/dev/uinput", O_WRONLY);
-    if (ofd == -1) {
-        fprintf(stderr, "\"/dev/uinput\": ");
-        perror("open");
+    if (capture_path && g_rt_priority > 0) {
+        /* Captures are written with stdio right from the input path */
+        fprintf(stderr, "Error: capture can't be recorded in realtime mode\n");
         exit(1);
     }
-    signal(SIGINT, sigint_handler);
-
-    setup_output_device(ofd);
+    if (capture_path) {
+        g_capture = fopen(capture_path, "wb");
+        if (g_capture == NULL) {
+            fprintf(stderr, "\"%s\": ", capture_path);
+            perror("fopen");
+            exit(1);
+        }
+    }
+    struct sigaction sa = { .sa_handler = sigint_handler };
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    struct sigaction sa_usr1 = { .sa_handler = sigusr1_handler };
+    sigemptyset(&sa_usr1.sa_mask);
+    sigaction(SIGUSR1, &sa_usr1, NULL);
 
-    int8_t abs_previous[ABS_CNT] = {0};
+    if (layout_path) {
+        layout_watch_open(layout_path);
+    }
+    output_keys_init();
+    if (g_layout_watch_fd != -1) {
+        pthread_t watcher;
+        const int err = pthread_create(&watcher, NULL, layout_watcher, (void *)layout_path);
+        if (err != 0)
+            fprintf(stderr, "pthread_create: %s, layout changes won't be picked up\n", strerror(err));
+        else
+            pthread_detach(watcher);
+    }
+    if (g_verbosity > 0) {
+        int err = pthread_create(&g_trace_drainer, NULL, trace_drainer, NULL);
+        if (err != 0) {
+            fprintf(stderr, "pthread_create: %s, tracing disabled\n", strerror(err));
+            g_verbosity = 0;
+        }
+    }
 
-    while (!g_should_stop) {
-        struct input_event ev;
-        ssize_t ret = read(g_ifd, &ev, sizeof(ev));
-        if (ret == -1) {
-            perror("read");
+    int epfd = -1;
+#ifdef USE_IO_URING
+    if (!uring_setup())
+        fprintf(stderr, "Warning: io_uring is not available, falling back to epoll\n");
+    if (g_uring.fd == -1)
+#endif
+    {
+        epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (epfd == -1) {
+            perror("epoll_create1");
             exit(1);
         }
-        switch (ev.type) {
-        case EV_KEY:
-            if (ev.value == 1) {
-                g_state = keypress(g_state, ev, ofd);
-            } else if (ev.value == 0) {
-                g_state = keyrelease(g_state, ev, ofd);
-            }
-            break;
-        case EV_ABS:
-            /*
-             * d-pad is EV_ABS
-             * left-right: code ABS_HAT0X, left=-1, right=1
-             * down-up: code ABS_HAT0Y, up=-1, down=1
-             */
-            if (ev.code == ABS_HAT0X || ev.code == ABS_HAT0Y) {
-                if (ev.value == 1 || ev.value == -1) {
-                    g_state = keypress(g_state, ev, ofd);
-                } else if (ev.value == 0) {
-                    g_state = keyrelease(g_state, ev, ofd);
-                }
-            } else if (ev.code == ABS_X || ev.code == ABS_Y || ev.code == ABS_RX || ev.code == ABS_RY) {
-                /*
-                 * Center stick position is about 127 or 128 on any axis.
-                 * Gonna convert these values to be consistent with d-pad
-                 * "analog" values.
-                 */
-                if ((ev.value - INT8_MAX) > (ABT + ABH)) {
-                    ev.value = 1;
-                } else if ((ev.value - INT8_MAX) < -(ABT + ABH)) {
-                    ev.value = -1;
-                } else if (((ev.value - INT8_MAX) > -(ABT - ABH)) &&
-                        ((ev.value - INT8_MAX) < (ABT - ABH))) {
-                    ev.value = 0;
-                } else {
-                    break;
-                }
-                /* Some filtering with abs_previous to mitigate duplicate events */
-                if (abs_previous[ev.code] != ev.value) {
-                    if (ev.value == 1 || ev.value == -1) {
-                        if (abs_previous[ev.code] != 0) {
-                            const int8_t value = ev.value;
-                            ev.value = 0;
-                            g_state = keyrelease(g_state, ev, ofd);
-                            ev.value = value;
-                        }
-                        g_state = keypress(g_state, ev, ofd);
-                        abs_previous[ev.code] = ev.value;
-                    } else if (ev.value == 0) {
-                        g_state = keyrelease(g_state, ev, ofd);
-                        abs_previous[ev.code] = ev.value;
-                    }
-                }
-            }
-            break;
-        default:
-            break;
+    }
+    /* Up front, so attaching a controller doesn't wait for the keyboard to appear */
+    output_get(0);
+    for (int i = optind; i < argc; i++) {
+        if (controller_open(argv[i], epfd, false) != 0)
+            exit(1);
+    }
+    g_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    struct epoll_event repeat_event = { .events = EPOLLIN, .data.ptr = &g_timer_fd };
+    if (g_timer_fd == -1 || (epfd != -1 && epoll_ctl(epfd, EPOLL_CTL_ADD, g_timer_fd, &repeat_event) == -1)) {
+        perror("timerfd");
+        exit(1);
+    }
+    if (monitor) {
+        g_uevent_fd = uevent_open(fake_uevent_path);
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = &g_uevent_fd };
+        if (epfd != -1 && epoll_ctl(epfd, EPOLL_CTL_ADD, g_uevent_fd, &event) == -1) {
+            perror("epoll_ctl(EPOLL_CTL_ADD)");
+            exit(1);
         }
+        if (fake_uevent_path == NULL)
+            uevent_coldplug(epfd);
     }
+    if (g_rt_priority > 0) {
+        /* After the trace drainer has been started, so it doesn't inherit it */
+        realtime_setup();
+    }
+
+#ifdef USE_IO_URING
+    if (g_uring.fd != -1)
+        uring_loop();
+    else
+        epoll_loop(epfd);
+#else
+    epoll_loop(epfd);
+#endif
+    if (g_should_stop)
+        printf("Received signal, quitting...\n");
 
-    ioctl(ofd, UI_DEV_DESTROY);
-    close(ofd);
+    for (size_t i = 0; i < CONTROLLERS_MAX; i++) {
+        if (g_controllers[i].used)
+            controller_close(&g_controllers[i], epfd);
+    }
+    for (size_t i = 0; i < CONTROLLERS_MAX; i++) {
+        output_destroy(&g_outputs[i]);
+    }
+    if (g_uevent_fd != -1) {
+        close(g_uevent_fd);
+        if (fake_uevent_path)
+            unlink(fake_uevent_path);
+    }
+    close(g_timer_fd);
+#ifdef USE_IO_URING
+    if (g_uring.fd != -1)
+        close(g_uring.fd);
+#endif
+    if (epfd != -1)
+        close(epfd);
+    if (g_capture) {
+        fclose(g_capture);
+    }
+    if (g_verbosity > 0) {
+        /* There must be only one consumer of the ring at a time */
+        atomic_store(&g_trace_stop, true);
+        pthread_join(g_trace_drainer, NULL);
+        trace_drain();
+    }
+    stats_dump(&g_telemetry->stats);
+    if (g_telemetry != &g_telemetry_private) {
+        munmap(g_telemetry, sizeof(*g_telemetry));
+        unlink(g_telemetry_path);
+    }
 
     return 0;
 }
@@ -0,0 +1,146 @@
+/* SPDX-License-Identifier: Unlicense
+ */
+
+/*
+ * Telemetry reader. Maps the page main publishes with -T read-only and prints
+ * a snapshot of it, once or every given number of milliseconds. Reading never
+ * disturbs main, see telemetry.h.
+ */
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "telemetry.h"
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * UINT64_C(1000000000) + (uint64_t)ts.tv_nsec;
+}
+
+static void print_snapshot(const struct telemetry *t)
+{
+    static const char *const stage_names[LATENCY_STAGES_NUM] = {
+        [LATENCY_KERNEL_TO_READ] = "kernel-to-read",
+        [LATENCY_READ_TO_COMMIT] = "read-to-commit",
+        [LATENCY_COMMIT_TO_WRITE] = "commit-to-write",
+    };
+    static const char *const modifier_names[MODIFIERS_NUM] = {
+        [MODIFIER_LT] = "lt",
+        [MODIFIER_RT] = "rt",
+        [MODIFIER_LB] = "lb",
+        [MODIFIER_RB] = "rb",
+    };
+    const uint64_t now = monotonic_ns();
+    printf("pid %" PRIu32 ", updated %" PRIu64 " ms ago\n", t->pid,
+            now > t->update_ns ? (now - t->update_ns) / 1000000 : 0);
+    for (size_t i = 0; i < TELEMETRY_CONTROLLERS_MAX; i++) {
+        const struct telemetry_controller *tc = &t->controllers[i];
+        if (!tc->used)
+            continue;
+        printf("Controller %zu: %s%s, %s mode, %" PRIu64 " events, keys 0x%08" PRIx32,
+                i,
+                tc->touchpad ? "touchpad" : "gamepad",
+                tc->hidraw ? " (hidraw)" : "",
+                tc->keyboard_mode ? "keyboard" : "gamepad",
+                tc->events,
+                tc->keys);
+        for (size_t m = 0; m < MODIFIERS_NUM; m++) {
+            const uint64_t since = tc->modifier_since_ns[m];
+            if (since && now > since && now - since > t->stuck_ns)
+                printf(", %s stuck for %" PRIu64 " s", modifier_names[m], (now - since) / 1000000000);
+        }
+        printf("\n");
+    }
+    const struct stats *stats = &t->stats;
+    printf("Latency, ns:\n");
+    for (size_t i = 0; i < LATENCY_STAGES_NUM; i++) {
+        const struct histogram *h = &stats->latency[i];
+        printf("  %-16s count=%" PRIu64 " avg=%" PRIu64 " p50<%" PRIu64 " p90<%" PRIu64
+                " p99<%" PRIu64 " max=%" PRIu64 "\n",
+                stage_names[i],
+                h->count,
+                h->count ? h->sum_ns / h->count : 0,
+                histogram_percentile(h, 50),
+                histogram_percentile(h, 90),
+                histogram_percentile(h, 99),
+                h->max_ns);
+    }
+    printf("Chord commits:\n");
+    for (size_t i = 0; i < CHORD_TABLE_SIZE; i++) {
+        if (stats->chord_hits[i])
+            printf("  %s 0x%02zx code=%u: %" PRIu64 ", entered in %" PRIu64 " ms on average\n",
+                    (i >> 8) == SIDE_LEFT ? "left" : "right",
+                    i & KMASK_CHORD_KEYS,
+                    t->chords[i],
+                    stats->chord_hits[i],
+                    stats->chord_entry_ns[i] / stats->chord_hits[i] / 1000000);
+    }
+    printf("Modifier presses:");
+    for (size_t i = 0; i < MODIFIERS_NUM; i++) {
+        printf(" %s=%" PRIu64, modifier_names[i], stats->modifier_presses[i]);
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned interval_ms = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "i:")) != -1) {
+        switch (opt) {
+        case 'i':
+            interval_ms = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-i interval ms] <telemetry page>\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "Error: No telemetry page specified\n");
+        exit(1);
+    }
+    const char *path = argv[optind];
+    const int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        fprintf(stderr, "\"%s\": ", path);
+        perror("open");
+        exit(1);
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(struct telemetry)) {
+        fprintf(stderr, "\"%s\": not a telemetry page of version %d\n", path, TELEMETRY_VERSION);
+        exit(1);
+    }
+    const struct telemetry *page = mmap(NULL, sizeof(*page), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (page == MAP_FAILED) {
+        fprintf(stderr, "\"%s\": ", path);
+        perror("mmap");
+        exit(1);
+    }
+    static struct telemetry snapshot;
+    do {
+        if (!telemetry_read(page, &snapshot)) {
+            fprintf(stderr, "\"%s\": page is being updated all the time\n", path);
+        } else if (memcmp(snapshot.magic, TELEMETRY_MAGIC, sizeof(snapshot.magic)) != 0 ||
+                snapshot.version != TELEMETRY_VERSION || snapshot.size != sizeof(snapshot)) {
+            fprintf(stderr, "\"%s\": not a telemetry page of version %d\n", path, TELEMETRY_VERSION);
+            exit(1);
+        } else {
+            print_snapshot(&snapshot);
+        }
+        if (interval_ms)
+            usleep(interval_ms * 1000);
+    } while (interval_ms);
+    return 0;
+}
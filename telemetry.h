@@ -0,0 +1,110 @@
+/* SPDX-License-Identifier: Unlicense
+ */
+
+/*
+ * Telemetry page shared by main and external monitors. With -T main keeps
+ * all of its statistics right in a file mapping, usually in /dev/shm, and
+ * readers map it read-only. The page is guarded by a seqlock: main makes the
+ * sequence odd before it touches the page and even when it is done, so a
+ * reader copies the page and retries if the sequence was odd or has changed
+ * meanwhile. Neither side makes a syscall or takes a lock for that.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "layout.h"
+
+/* Log2 buckets of nanoseconds, bucket N holds values in [2^(N-1), 2^N) */
+#define HISTOGRAM_BUCKETS 64
+
+struct histogram {
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+};
+
+enum latency_stage {
+    LATENCY_KERNEL_TO_READ = 0,
+    LATENCY_READ_TO_COMMIT = 1,
+    LATENCY_COMMIT_TO_WRITE = 2,
+    LATENCY_STAGES_NUM,
+};
+
+/* Fixed size statistics, dumped on SIGUSR1 and on exit */
+struct stats {
+    struct histogram latency[LATENCY_STAGES_NUM];
+    uint64_t chord_hits[CHORD_TABLE_SIZE];
+    uint64_t chord_entry_ns[CHORD_TABLE_SIZE]; // From the first press to the commit, summed
+    uint64_t modifier_presses[MODIFIERS_NUM];
+    uint64_t stick_filtered;
+    uint64_t touch_samples;
+    uint64_t touch_frames;
+};
+
+#define TELEMETRY_MAGIC "DS4TELEM"
+#define TELEMETRY_VERSION 2
+#define TELEMETRY_CONTROLLERS_MAX 8
+/* A modifier held for longer than that is reported as stuck */
+#define TELEMETRY_STUCK_NS (10 * UINT64_C(1000000000))
+
+struct telemetry_controller {
+    uint64_t events; // Input events, or reports for hidraw
+    /* CLOCK_MONOTONIC time the modifier has been pressed at, zero if released */
+    uint64_t modifier_since_ns[MODIFIERS_NUM];
+    uint32_t keys; // State keys mask, see enum keys_mask
+    uint8_t used;
+    uint8_t keyboard_mode;
+    uint8_t touchpad;
+    uint8_t hidraw;
+};
+
+struct telemetry {
+    char magic[8];
+    uint32_t version;
+    uint32_t size; // sizeof(struct telemetry), guards against ABI mismatch
+    uint32_t sequence; // Odd while main updates the page
+    uint32_t pid;
+    uint64_t stuck_ns;
+    uint64_t update_ns; // CLOCK_MONOTONIC time of the last update
+    /* Output key code of every chord, as in struct layout */
+    uint16_t chords[CHORD_TABLE_SIZE];
+    struct telemetry_controller controllers[TELEMETRY_CONTROLLERS_MAX];
+    struct stats stats;
+};
+
+/* Returns the upper bound of the bucket where the percentile falls */
+static inline uint64_t histogram_percentile(const struct histogram *h, unsigned percent)
+{
+    const uint64_t target = (h->count * percent + 99) / 100;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= target && seen)
+            return i ? UINT64_C(1) << i : 0;
+    }
+    return h->max_ns;
+}
+
+/*
+ * Copies a consistent snapshot of the page, returns false if main has been
+ * updating it all the time.
+ */
+static inline bool telemetry_read(const struct telemetry *page, struct telemetry *snapshot)
+{
+    for (int attempt = 0; attempt < 1000; attempt++) {
+        const uint32_t sequence = __atomic_load_n(&page->sequence, __ATOMIC_ACQUIRE);
+        if (sequence & 1)
+            continue;
+        memcpy(snapshot, page, sizeof(*snapshot));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&page->sequence, __ATOMIC_RELAXED) == sequence)
+            return true;
+    }
+    return false;
+}